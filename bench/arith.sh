@@ -0,0 +1,22 @@
+#!/bin/bash
+# One call to + with ARITH_ARGS arguments, made ARITH_REPS times: all
+# longs, and longs with every tenth argument a double. The first argument
+# is the loop counter, so the calls aren't folded to constants.
+. "$(dirname "$0")/common.sh"
+ARITH_ARGS=${ARITH_ARGS:-10000}
+ARITH_REPS=${ARITH_REPS:-1000}
+
+run() {
+	{
+		printf "(fun {rep n x} {if (== n 0) {x} {rep (- n 1) (+ n "
+		awk -v n="$ARITH_ARGS" -v dot="$1" 'BEGIN {
+			for (i = 2; i <= n; i++) printf " %d%s", i, (dot && i % 10 == 0 ? ".5" : "")
+		}'
+		printf ")}})\n"
+		printf "(print (rep %d 0))\n" "$ARITH_REPS"
+	} > "$TMP/arith.lispr"
+	bench "$2, $ARITH_ARGS args x$ARITH_REPS" "$TMP/arith.lispr"
+}
+
+run "" "longs"
+run 1 "mixed"
@@ -0,0 +1,21 @@
+#!/bin/bash
+# Integer arithmetic past 64 bits: factorial 1000 and 2^100000, each
+# computed BIGNUM_REPS times, and a double power with a huge exponent.
+# Results are printed mod 1000000007 so they can be checked against any
+# other bignum library: 641419708 and 607723520. The base is passed in as
+# b, so the calls aren't folded to constants.
+. "$(dirname "$0")/common.sh"
+BIGNUM_REPS=${BIGNUM_REPS:-100}
+
+run() {
+	{
+		printf "(fun {fact n acc} {if (== n 0) {acc} {fact (- n 1) (* acc n)}})\n"
+		printf "(fun {rep n b x} {if (== n 1) {x} {rep (- n 1) b %s}})\n" "$1"
+		printf "(print (rep %d %s 0))\n" "$((BIGNUM_REPS + 1))" "$2"
+	} > "$TMP/bignum.lispr"
+	bench "$3" "$TMP/bignum.lispr"
+}
+
+run "(% (fact 1000 b) 1000000007)" 1 "factorial 1000, x$BIGNUM_REPS"
+run "(% (^ b 100000) 1000000007)" 2 "2^100000, x$BIGNUM_REPS"
+run "(^ b 1000000000)" 1.00000001 "1.00000001^1e9, x$BIGNUM_REPS"
@@ -0,0 +1,27 @@
+#!/bin/bash
+# Conditionals: a compiled classifier guarded by && and ||, called
+# BRANCH_ITERS times, and an if-heavy body run through eval, which the
+# tree walker handles, BRANCH_ITERS / 2 times. Prints lval allocations per
+# iteration from alloc-stats.
+. "$(dirname "$0")/common.sh"
+BRANCH_ITERS=${BRANCH_ITERS:-1000000}
+
+# run NAME ITERS DEFS: DEFS defines cls; the loop calls it ITERS times
+run() {
+	{
+		printf "%s\n" "$3"
+		printf "(def {loop} (\\\\ {i acc} {if (== i 0) {acc} {loop (- i 1) (+ acc (cls (%% i 300)))}}))\n"
+		echo "(alloc-stats ())"
+		printf "(def {r} (loop %d 0))\n" "$2"
+		echo "(alloc-stats ())"
+		echo "(print r)"
+	} > "$TMP/branch.lispr"
+	bench "$1" "$TMP/branch.lispr"
+	awk -v n="$2" -v a="$(( $(alloc_stat lval allocated 2) - $(alloc_stat lval allocated 1) ))" \
+		'BEGIN { printf "    %.1f lval allocations per iteration\n", a / n }'
+}
+
+run "&& and || guards, $BRANCH_ITERS calls" "$BRANCH_ITERS" \
+	"(def {cls} (\\ {n} {if (&& (> n 0) (< n 10)) {1} {if (|| (== n 0) (> n 150)) {2} {3}}}))"
+run "eval'd if, $((BRANCH_ITERS / 2)) calls" "$((BRANCH_ITERS / 2))" \
+	"(def {cls} (\\ {n} {eval {if (> n 0) {if (> n 100) {2} {1}} {0}}}))"
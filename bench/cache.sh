@@ -0,0 +1,32 @@
+#!/bin/bash
+# Global lookups from compiled code, which the per-site inline caches
+# serve. Scoping is dynamic, so without them a reference to a global such
+# as + walks every frame of the call chain: deep non-tail recursion pays
+# for its depth on every lookup. Prints the cache hits and misses from
+# alloc-stats for each case.
+. "$(dirname "$0")/common.sh"
+CACHE_DEPTH=${CACHE_DEPTH:-3000}
+CACHE_REPS=${CACHE_REPS:-100}
+CACHE_ITERS=${CACHE_ITERS:-2000000}
+
+# run NAME DEFS EXPR
+run() {
+	{
+		printf "%s\n(def {r} %s)\n" "$2" "$3"
+		echo "(alloc-stats ())"
+		echo "(print r)"
+	} > "$TMP/cache.lispr"
+	bench "$1" "$TMP/cache.lispr"
+	echo "    $(grep '^lookup cache' "$TMP/out" || echo 'no lookup cache')"
+}
+
+run "fib 27" \
+	"(def {fibx} (\\ {n} {if (< n 2) {n} {+ (fibx (- n 1)) (fibx (- n 2))}}))" \
+	"(fibx 27)"
+run "sum to $CACHE_DEPTH, non-tail, x$CACHE_REPS" \
+	"(def {sumto} (\\ {n} {if (== n 0) {0} {+ n (sumto (- n 1))}}))
+(def {rep} (\\ {k acc} {if (== k 0) {acc} {rep (- k 1) (sumto $CACHE_DEPTH)}}))" \
+	"(rep $CACHE_REPS 0)"
+run "10 adds, $CACHE_ITERS iterations" \
+	"(def {loop} (\\ {n a b} {if (== n 0) {a} {loop (- n 1) (- (+ (+ (+ (+ (+ (+ (+ (+ (+ (+ a b) b) b) b) b) b) b) b) b) b) (* b 10)) b}}))" \
+	"(loop $CACHE_ITERS 1000000 3)"
@@ -0,0 +1,37 @@
+#!/bin/bash
+# Cost of calling a lambda: lval and lenv allocations per step, from
+# alloc-stats around each run, and time. Three kinds of call: fib's
+# non-tail calls (a step is a call), a CALLS_ITERS-iteration
+# tail-recursive loop, and partial application, ((add3 1) 2 3), in such
+# a loop (a step is an iteration).
+. "$(dirname "$0")/common.sh"
+CALLS_ITERS=${CALLS_ITERS:-200000}
+
+# run NAME STEPS DEFS EXPR: evaluates EXPR, which takes STEPS steps
+run() {
+	{
+		printf "%s\n" "$3"
+		echo "(alloc-stats ())"
+		printf "(def {r} %s)\n" "$4"
+		echo "(alloc-stats ())"
+		echo "(print r)"
+	} > "$TMP/calls.lispr"
+	bench "$1" "$TMP/calls.lispr"
+	awk -v n="$2" \
+		-v lv="$(( $(alloc_stat lval allocated 2) - $(alloc_stat lval allocated 1) ))" \
+		-v le="$(( $(alloc_stat lenv allocated 2) - $(alloc_stat lenv allocated 1) ))" \
+		-v live="$(alloc_stat lenv live 2)" 'BEGIN {
+		printf "    %.1f lval and %.1f lenv allocations per step, %d lenv live after\n", lv / n, le / n, live
+	}'
+}
+
+run "fib 23" 92735 \
+	"(def {fibx} (\\ {n} {if (< n 2) {n} {+ (fibx (- n 1)) (fibx (- n 2))}}))" \
+	"(fibx 23)"
+run "tail loop, $CALLS_ITERS calls" "$CALLS_ITERS" \
+	"(def {loop} (\\ {i acc} {if (== i 0) {acc} {loop (- i 1) (+ acc 1)}}))" \
+	"(loop $CALLS_ITERS 0)"
+run "((add3 1) 2 3), $CALLS_ITERS times" "$CALLS_ITERS" \
+	"(def {add3} (\\ {a b c} {+ a b c}))
+(def {go} (\\ {n acc} {if (== n 0) {acc} {go (- n 1) (+ acc ((add3 1) 2 3))}}))" \
+	"(go $CALLS_ITERS 0)"
@@ -0,0 +1,85 @@
+# Helpers shared by the benchmark scripts, which source this file. They
+# run from the repository root, where lispr finds stdlib.lispr, and
+# measure the interpreter named by LISPR (./lispr by default).
+
+cd "$(dirname "$0")/.." || exit 1
+LISPR=${LISPR:-./lispr}
+if [ ! -x "$LISPR" ]; then
+	echo "$0: no interpreter at $LISPR; build one or set LISPR" >&2
+	exit 1
+fi
+TMP=$(mktemp -d "${TMPDIR:-/tmp}/lispr-bench.XXXXXX") || exit 1
+trap 'rm -rf "$TMP"' EXIT
+
+# Peak RSS in KB of the process whose pid is written to $TMP/pid, polled
+# from /proc (0 where there is no /proc, or for a very short run)
+rss_poll() {
+	while [ ! -s "$TMP/pid" ]; do sleep 0.01; done
+	pid=$(cat "$TMP/pid")
+	hwm=0
+	while [ -r "/proc/$pid/status" ]; do
+		h=$(awk '/^VmHWM/ { print $2 }' "/proc/$pid/status" 2>/dev/null)
+		[ -n "$h" ] && hwm=$h
+		sleep 0.01
+	done
+	echo "$hwm" > "$TMP/rss"
+}
+
+# bench NAME FILE...: loads the files with stdin empty, then prints NAME,
+# wall and user seconds, peak RSS and the last line the program printed.
+# The whole output is left in $TMP/out.
+bench() {
+	name=$1
+	shift
+	rm -f "$TMP/pid" "$TMP/rss"
+	rss_poll &
+	poller=$!
+	TIMEFORMAT="%R %U"
+	t=$( { time sh -c 'echo $$ > "$0"; exec "$@"' "$TMP/pid" "$LISPR" "$@" \
+		< /dev/null > "$TMP/out.raw" 2>&1; } 2>&1 )
+	wait "$poller"
+	# Drop the banner and any prompt
+	sed -e '/^Lispr Version/d' -e '/^Press ctrl+c/d' -e 's/^lispr> //' \
+		-e '/^$/d' "$TMP/out.raw" > "$TMP/out"
+	# Too short a run to catch shows as -
+	rss=$(cat "$TMP/rss")
+	[ "$rss" = 0 ] && rss=-
+	set -- $t
+	printf '%-32s %7ss wall %7ss user %8s KB  %s\n' "$name" "$1" "$2" \
+		"$rss" "$(tail -n 1 "$TMP/out" | cut -c1-40)"
+}
+
+# alloc_stat NAME FIELD [N]: a number from the Nth (by default the last)
+# alloc-stats report in $TMP/out, such as "lval allocated" or "lval bytes"
+alloc_stat() {
+	awk -v name="$1" -v field="$2" -v nth="${3:-0}" '
+		$1 == name ":" {
+			n++
+			for (i = 3; i <= NF; i++) {
+				w = $i
+				sub(/,$/, "", w)
+				if (w == field) v[n] = $(i-1)
+			}
+		}
+		END { print v[nth ? nth : n] + 0 }
+	' "$TMP/out"
+}
+
+# A list literal of n numbers: 1..n, plus offset, as doubles if dot is
+# ".5" (say)
+gen_list() {
+	awk -v n="$1" -v off="${2:-0}" -v dot="$3" 'BEGIN {
+		printf "{"
+		for (i = 1; i <= n; i++) printf "%s%d%s", (i > 1 ? " " : ""), i + off, dot
+		printf "}"
+	}'
+}
+
+# n small definitions mixing strings, doubles and nested lists
+gen_defs() {
+	awk -v n="$1" 'BEGIN {
+		for (i = 1; i <= n; i++) {
+			printf "(def {v%d} {\"name %d\" %d.25 (+ %d 1) {%d {%d %d}}})\n", i, i, i, i, i, i + 1, i + 2
+		}
+	}'
+}
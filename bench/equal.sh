@@ -0,0 +1,25 @@
+#!/bin/bash
+# == and != on two equal EQ_SIZES-element lists, read separately, and one
+# differing only in its last element, EQ_REPS times. The live lval count
+# from alloc-stats is printed before and after the loop: comparisons
+# shouldn't allocate, so it should not grow with EQ_REPS.
+. "$(dirname "$0")/common.sh"
+EQ_SIZES=${EQ_SIZES:-"100000 1000000"}
+EQ_REPS=${EQ_REPS:-100}
+
+for n in $EQ_SIZES; do
+	{
+		printf "(def {a} "
+		gen_list "$n"
+		printf ")\n(def {b} "
+		gen_list "$n"
+		printf ")\n(def {c} (join (init a) {0}))\n"
+		printf "(fun {rep i k} {if (== i 0) {k} {rep (- i 1) (+ k (if (== a b) {1} {0}) (if (!= a c) {1} {0}))}})\n"
+		echo "(alloc-stats ())"
+		printf "(def {k} (rep %d 0))\n" "$EQ_REPS"
+		echo "(alloc-stats ())"
+		echo "(print k)"
+	} > "$TMP/equal.lispr"
+	bench "== and !=, $n elements x$EQ_REPS" "$TMP/equal.lispr"
+	echo "    lval live $(alloc_stat lval live 1) before, $(alloc_stat lval live 2) after"
+done
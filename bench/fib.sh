@@ -0,0 +1,14 @@
+#!/bin/bash
+# Doubly recursive fib of each of FIB_N: a lambda call, a comparison and
+# two arithmetic calls per step, none of them tail calls. Written with
+# if, as stdlib's fib is written with select.
+. "$(dirname "$0")/common.sh"
+FIB_N=${FIB_N:-"25 27"}
+
+for n in $FIB_N; do
+	{
+		printf "(def {fibx} (\\\\ {n} {if (< n 2) {n} {+ (fibx (- n 1)) (fibx (- n 2))}}))\n"
+		printf "(print (fibx %d))\n" "$n"
+	} > "$TMP/fib.lispr"
+	bench "fib $n" "$TMP/fib.lispr"
+done
@@ -0,0 +1,28 @@
+#!/bin/bash
+# Machine code against the bytecode interpreter: each program runs with
+# the JIT and with --no-jit. fib JIT_FIB, and JIT_ITERS-iteration loops
+# of arithmetic on longs, on doubles and guarded by && and ||. Builds
+# without a JIT (LISPR_NO_JIT, or not x86-64 Linux) time the same twice.
+. "$(dirname "$0")/common.sh"
+JIT_FIB=${JIT_FIB:-30}
+JIT_ITERS=${JIT_ITERS:-2000000}
+
+run() {
+	printf "%s\n" "$2" > "$TMP/jit.lispr"
+	bench "$1, jit" "$TMP/jit.lispr"
+	bench "$1, --no-jit" --no-jit "$TMP/jit.lispr"
+}
+
+run "fib $JIT_FIB" \
+	"(def {fibx} (\\ {n} {if (< n 2) {n} {+ (fibx (- n 1)) (fibx (- n 2))}}))
+(print (fibx $JIT_FIB))"
+for kind in long double; do
+	if [ $kind = long ]; then a=1000000 b=3; else a=1000000.5 b=0.25; fi
+	run "$kind arithmetic, $JIT_ITERS" \
+		"(def {loop} (\\ {n a b} {if (== n 0) {a} {loop (- n 1) (- (+ (+ (+ (+ (+ (+ (+ (+ (+ (+ a b) b) b) b) b) b) b) b) b) b) (* b 10)) b}}))
+(print (loop $JIT_ITERS $a $b))"
+done
+run "&& / || guards, $JIT_ITERS" \
+	"(def {cls} (\\ {n} {if (&& (> n 0) (< n 10)) {1} {if (|| (== n 0) (> n 150)) {2} {3}}}))
+(def {loop} (\\ {i acc} {if (== i 0) {acc} {loop (- i 1) (+ acc (cls (% i 200)))}}))
+(print (loop $JIT_ITERS 0))"
@@ -0,0 +1,18 @@
+#!/bin/bash
+# (len big) on a LEN_SIZE-element list, LEN_ITERS times, against just
+# reading the list. With shared values each call is O(1), so the two
+# should be close.
+. "$(dirname "$0")/common.sh"
+LEN_SIZE=${LEN_SIZE:-100000}
+LEN_ITERS=${LEN_ITERS:-"0 200 20000"}
+
+for iters in $LEN_ITERS; do
+	{
+		printf "(def {big} "
+		gen_list "$LEN_SIZE"
+		printf ")\n"
+		printf "(def {loop} (\\\\ {i acc} {if (== i 0) {acc} {loop (- i 1) (+ acc (len big))}}))\n"
+		printf "(print (loop %d 0))\n" "$iters"
+	} > "$TMP/len.lispr"
+	bench "$iters calls, $LEN_SIZE elements" "$TMP/len.lispr"
+done
@@ -0,0 +1,29 @@
+#!/bin/bash
+# map, filter and foldl over lists of each of SIZES elements, against
+# just reading the list. With shared structure in tail and join the Lisp
+# definitions are linear too; time them with a -DLISPR_LISP_LISTS build:
+#
+#   LISPR=./lispr-lisp-lists bench/lists.sh
+#
+# The Lisp map and filter recurse once per element on the C stack, so the
+# stack limit is raised for them.
+. "$(dirname "$0")/common.sh"
+SIZES=${SIZES:-"1000 10000 100000 1000000"}
+ulimit -s unlimited 2>/dev/null || ulimit -s "$(ulimit -Hs)"
+
+for n in $SIZES; do
+	for op in read map filter foldl; do
+		{
+			printf "(def {big} "
+			gen_list "$n"
+			printf ")\n"
+			case $op in
+			read)   printf "(print (len big))\n" ;;
+			map)    printf "(print (len (map (\\\\ {x} {* x 2}) big)))\n" ;;
+			filter) printf "(print (len (filter (\\\\ {x} {== (%% x 2) 0}) big)))\n" ;;
+			foldl)  printf "(print (foldl + 0 big))\n" ;;
+			esac
+		} > "$TMP/lists.lispr"
+		bench "$op, $n elements" "$TMP/lists.lispr"
+	done
+done
@@ -0,0 +1,17 @@
+#!/bin/bash
+# Global lookups as the number of globals grows: N definitions, then a
+# loop making LOOKUP_ITERS iterations that each read four of them. With a
+# hashed environment the time should stay flat as N grows.
+. "$(dirname "$0")/common.sh"
+SIZES=${SIZES:-"50 500 5000 50000"}
+LOOKUP_ITERS=${LOOKUP_ITERS:-400000}
+
+for n in $SIZES; do
+	awk -v n="$n" -v iters="$LOOKUP_ITERS" 'BEGIN {
+		for (i = 1; i <= n; i++) printf "(def {g%d} %d)\n", i, i
+		printf "(def {loop} (\\ {i acc} {if (== i 0) {acc} "
+		printf "{loop (- i 1) (+ acc g1 g%d g%d g%d)}}))\n", int(n/3), int(2*n/3), n
+		printf "(print (loop %d 0))\n", iters
+	}' > "$TMP/lookup.lispr"
+	bench "$n globals" "$TMP/lookup.lispr"
+done
@@ -0,0 +1,33 @@
+#!/bin/bash
+# load wall time and peak RSS for MMAP_MB MB of generated source: long
+# string literals, and small definitions. Both cycle over a thousand
+# names, so what stays live is small and RSS is the loader's own.
+# Compare with a build that reads files instead of mapping them:
+#
+#   gcc -std=c99 -O2 -fcommon -DLISPR_NO_MMAP prompt.c functions.c mpc.c \
+#       -ledit -lm -o lispr-no-mmap
+#   LISPR=./lispr-no-mmap bench/mmap.sh
+. "$(dirname "$0")/common.sh"
+MMAP_MB=${MMAP_MB:-200}
+
+awk -v max="$((MMAP_MB * 1024 * 1024))" 'BEGIN {
+	s = "lorem ipsum dolor sit amet"
+	while (length(s) < 4000) s = s " " s
+	for (i = 1; size < max; i++) {
+		line = sprintf("(def {s%d} \"%d %s\")", i % 1000, i, s)
+		print line
+		size += length(line) + 1
+	}
+	printf "(print (len (list s%d)))\n", (i - 1) % 1000
+}' > "$TMP/strings.lispr"
+bench "strings, $(( $(wc -c < "$TMP/strings.lispr") / 1048576 )) MB" "$TMP/strings.lispr"
+
+awk -v max="$((MMAP_MB * 1024 * 1024))" 'BEGIN {
+	for (i = 1; size < max; i++) {
+		line = sprintf("(def {v%d} {\"name %d\" %d.25 (+ %d 1) {%d {%d %d}}})", i % 1000, i, i, i, i, i + 1, i + 2)
+		print line
+		size += length(line) + 1
+	}
+	print "(print (len v1))"
+}' > "$TMP/defs.lispr"
+bench "defs, $(( $(wc -c < "$TMP/defs.lispr") / 1048576 )) MB" "$TMP/defs.lispr"
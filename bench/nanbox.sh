@@ -0,0 +1,41 @@
+#!/bin/bash
+# A NANBOX_ITERS-iteration loop with no additions, and with ten nested
+# (+ acc a) and (+ acc b) per iteration, on longs and on doubles. From
+# the difference it prints lval allocations per iteration and ns per
+# addition. Compare with a NaN-boxed build:
+#
+#   gcc -std=c99 -O2 -fcommon -DLISPR_NANBOX prompt.c functions.c mpc.c \
+#       -ledit -lm -o lispr-nanbox
+#   LISPR=./lispr-nanbox bench/nanbox.sh
+. "$(dirname "$0")/common.sh"
+NANBOX_ITERS=${NANBOX_ITERS:-2000000}
+
+# run ADDS A B: leaves user seconds in $user and lvals allocated in $allocs
+run() {
+	expr=acc
+	for ((k = 0; k < $1; k++)); do
+		if ((k % 2)); then expr="(+ $expr b)"; else expr="(+ $expr a)"; fi
+	done
+	{
+		printf "(fun {loop i a b acc} {if (== i 0) {acc} {loop (- i 1) a b %s}})\n" "$expr"
+		echo "(alloc-stats ())"
+		printf "(def {r} (loop %d %s %s 0))\n" "$NANBOX_ITERS" "$2" "$3"
+		echo "(alloc-stats ())"
+		echo "(print r)"
+	} > "$TMP/nanbox.lispr"
+	bench "$1 additions, $NANBOX_ITERS iterations" "$TMP/nanbox.lispr"
+	user=$(set -- $t; echo "$2")
+	allocs=$(( $(alloc_stat lval allocated 2) - $(alloc_stat lval allocated 1) ))
+}
+
+for kind in longs doubles; do
+	if [ $kind = longs ]; then a=3 b=4; else a=1.5 b=2.25; fi
+	echo "$kind:"
+	run 0 $a $b
+	user0=$user allocs0=$allocs
+	run 10 $a $b
+	awk -v n="$NANBOX_ITERS" -v a0="$allocs0" -v a1="$allocs" -v t0="$user0" -v t1="$user" 'BEGIN {
+		printf "    %.2f lval allocations per iteration without additions, %.2f with\n", a0 / n, a1 / n
+		printf "    %.1f ns per addition\n", (t1 - t0) * 1e9 / (n * 10)
+	}'
+done
@@ -0,0 +1,30 @@
+#!/bin/bash
+# Memory per element of MEM_SIZE-element numeric lists: growth of the lval
+# slabs between two alloc-stats reports, around reading the list, plus
+# the list's 8-byte cell slot. Small integers come out as 8 bytes, since
+# they are preallocated.
+. "$(dirname "$0")/common.sh"
+MEM_SIZE=${MEM_SIZE:-200000}
+
+for kind in small large double; do
+	{
+		echo "(alloc-stats ())"
+		printf "(def {l} "
+		case $kind in
+			small) awk -v n="$MEM_SIZE" 'BEGIN {
+				printf "{"
+				for (i = 1; i <= n; i++) printf "%s%d", (i > 1 ? " " : ""), i % 1000
+				printf "}"
+			}' ;;
+			large) gen_list "$MEM_SIZE" 1000000 ;;
+			double) gen_list "$MEM_SIZE" 0 .5 ;;
+		esac
+		printf ")\n"
+		echo "(alloc-stats ())"
+		echo "(print (len l))"
+	} > "$TMP/mem.lispr"
+	bench "$kind numbers, $MEM_SIZE" "$TMP/mem.lispr"
+	before=$(alloc_stat lval bytes 1)
+	after=$(alloc_stat lval bytes 2)
+	echo "    $(( (after - before) / MEM_SIZE + 8 )) bytes per element"
+done
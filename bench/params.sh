@@ -0,0 +1,18 @@
+#!/bin/bash
+# Parameter references: a six-parameter lambda whose body reads each
+# parameter twice, called PARAMS_ITERS times from a loop, against the same
+# loop calling a lambda that reads none of them.
+. "$(dirname "$0")/common.sh"
+PARAMS_ITERS=${PARAMS_ITERS:-500000}
+
+run() {
+	{
+		printf "(def {f} (\\\\ {a b c d e g} {%s}))\n" "$1"
+		printf "(def {loop} (\\\\ {i acc} {if (== i 0) {acc} {loop (- i 1) (+ acc (f i 1 2 3 4 5))}}))\n"
+		printf "(print (loop %d 0))\n" "$PARAMS_ITERS"
+	} > "$TMP/params.lispr"
+	bench "$2, $PARAMS_ITERS calls" "$TMP/params.lispr"
+}
+
+run "+ 1" "no parameters read"
+run "+ a b c d e g (- a b c d e g)" "12 parameter reads"
@@ -0,0 +1,23 @@
+#!/bin/bash
+# load of generated source: one list of PARSE_LIST numbers (about 8 MB
+# at the default size) and PARSE_DEFS small definitions. Each file is
+# timed against an empty one, so the difference is the time to read it.
+. "$(dirname "$0")/common.sh"
+PARSE_LIST=${PARSE_LIST:-1000000}
+PARSE_DEFS=${PARSE_DEFS:-40000}
+
+: > "$TMP/empty.lispr"
+bench "empty file" "$TMP/empty.lispr"
+
+{
+	printf "(def {l} "
+	gen_list "$PARSE_LIST" 1000000
+	printf ")\n(print (len l))\n"
+} > "$TMP/list.lispr"
+bench "one list, $(( $(wc -c < "$TMP/list.lispr") / 1024 )) KB" "$TMP/list.lispr"
+
+{
+	gen_defs "$PARSE_DEFS"
+	printf "(print (len v%d))\n" "$PARSE_DEFS"
+} > "$TMP/defs.lispr"
+bench "$PARSE_DEFS defs, $(( $(wc -c < "$TMP/defs.lispr") / 1024 )) KB" "$TMP/defs.lispr"
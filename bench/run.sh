@@ -0,0 +1,21 @@
+#!/bin/bash
+# Runs the benchmarks named (by default all of them) against the
+# interpreter named by LISPR, ./lispr by default:
+#
+#   bench/run.sh                        everything
+#   LISPR=./lispr-nanbox bench/run.sh arith nanbox
+#
+# Each bench/NAME.sh prints one line per case: wall and user time, peak
+# RSS and the last thing the program printed. Some also print figures
+# derived from alloc-stats. Sizes can be changed through the variables at
+# the top of each script.
+cd "$(dirname "$0")" || exit 1
+if [ $# -eq 0 ]; then
+	set -- $(ls *.sh | sed -e '/^common\.sh$/d' -e '/^run\.sh$/d' -e 's/\.sh$//')
+fi
+status=0
+for b in "$@"; do
+	echo "== $b"
+	bash "./$b.sh" || status=1
+done
+exit $status
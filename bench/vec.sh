@@ -0,0 +1,25 @@
+#!/bin/bash
+# Reductions over VEC_SIZE doubles: foldl and stdlib sum over the list,
+# VEC_REPS times, against vec-sum and dot over the same numbers as a vec,
+# VEC_FAST_REPS times. The read case only builds the list and the vec.
+. "$(dirname "$0")/common.sh"
+VEC_SIZE=${VEC_SIZE:-100000}
+VEC_REPS=${VEC_REPS:-100}
+VEC_FAST_REPS=${VEC_FAST_REPS:-10000}
+
+run() {
+	{
+		printf "(def {l} "
+		gen_list "$VEC_SIZE" 0 .5
+		printf ")\n(def {v} (vec l))\n"
+		printf "(fun {rep n x} {if (== n 0) {x} {rep (- n 1) %s}})\n" "$1"
+		printf "(print (rep %d 0))\n" "$3"
+	} > "$TMP/vec.lispr"
+	bench "$2, $VEC_SIZE doubles x$3" "$TMP/vec.lispr"
+}
+
+run "(len l)" "read" 1
+run "(foldl + 0 l)" "foldl +" "$VEC_REPS"
+run "(sum l)" "sum" "$VEC_REPS"
+run "(vec-sum v)" "vec-sum" "$VEC_FAST_REPS"
+run "(dot v v)" "dot" "$VEC_FAST_REPS"
@@ -1,15 +1,392 @@
+#if defined(__x86_64__) && defined(__linux__) && !defined(LISPR_NO_JIT)
+// Hot lambda bodies are compiled to machine code (see jit_compile)
+#define LISPR_JIT
+#define _DEFAULT_SOURCE
+#include <sys/mman.h>
+#include <stdarg.h>
+#include <stddef.h>
+#endif
+#if !defined(_WIN32) && !defined(LISPR_NO_MMAP)
+// load maps regular files into memory
+#define LISPR_MMAP
+#define _POSIX_C_SOURCE 200809L
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
 #include "functions.h"
+#if defined(__AVX__) || defined(__SSE2__)
+#include <immintrin.h>
+#endif
+
+// lvals and lenvs are allocated from slabs: pages of SLAB_PAGE_OBJECTS
+// fixed-size objects, with freed objects kept on a free list for reuse.
+// Build with -DLISPR_SYSTEM_ALLOC to use malloc and free directly, e.g.
+// when running under valgrind.
+//
+// Build with -DLISPR_GC to reclaim memory with a mark-and-sweep collector
+// instead of reference counts. In that mode lval_del does nothing, owner
+// counts only record whether a value may be shared, and unreachable
+// objects are swept page by page. Roots are found by scanning the C stack
+// conservatively, so every live lval or lenv is either referenced from the
+// stack or from another live object.
+#define SLAB_PAGE_OBJECTS 1024
+
+#if defined(LISPR_GC) && defined(LISPR_SYSTEM_ALLOC)
+#error "LISPR_GC needs the slab allocator"
+#endif
+
+struct slab_page;
+
+typedef struct slab {
+	size_t size;
+	void* free;
+	long pages;
+	long allocs;
+	long frees;
+	struct slab_page* current;
+} slab;
+
+static slab lval_slab = { sizeof(lval), NULL, 0, 0, 0, NULL };
+static slab lenv_slab = { sizeof(lenv), NULL, 0, 0, 0, NULL };
+
+#ifdef LISPR_GC
+// Each page keeps its own free list plus a live and a mark flag per object
+typedef struct slab_page {
+	char* base;
+	slab* owner;
+	void* free;
+	int nfree;
+	unsigned char live[SLAB_PAGE_OBJECTS];
+	unsigned char mark[SLAB_PAGE_OBJECTS];
+} slab_page;
+
+// Pages of both slabs, sorted by address so that an arbitrary word can be
+// mapped back to the object it points into
+static slab_page** gc_pages = NULL;
+static int gc_page_count = 0;
+
+static void** gc_stack_base = NULL;
+static long gc_allocs = 0;
+static long gc_threshold = GC_MIN_THRESHOLD;
+static long gc_collections = 0;
+
+slab_page* slab_new_page(slab* s) {
+	slab_page* p = malloc(sizeof(slab_page));
+	p->base = malloc(s->size * SLAB_PAGE_OBJECTS);
+	p->owner = s;
+	p->free = NULL;
+	p->nfree = SLAB_PAGE_OBJECTS;
+	for (int i = SLAB_PAGE_OBJECTS-1; i >= 0; i--) {
+		void** obj = (void**) (p->base + i * s->size);
+		*obj = p->free;
+		p->free = obj;
+	}
+	memset(p->live, 0, SLAB_PAGE_OBJECTS);
+	memset(p->mark, 0, SLAB_PAGE_OBJECTS);
+	s->pages++;
+
+	// Insert keeping gc_pages sorted by base address
+	gc_pages = realloc(gc_pages, sizeof(slab_page*) * (gc_page_count+1));
+	int i = gc_page_count++;
+	while (i > 0 && gc_pages[i-1]->base > p->base) {
+		gc_pages[i] = gc_pages[i-1];
+		i--;
+	}
+	gc_pages[i] = p;
+	return p;
+}
+
+// Page containing address a, or NULL if a isn't inside any slab page
+slab_page* gc_find_page(void* a) {
+	char* c = a;
+	int lo = 0, hi = gc_page_count - 1;
+	while (lo <= hi) {
+		int mid = (lo + hi) / 2;
+		slab_page* p = gc_pages[mid];
+		if (c < p->base) {
+			hi = mid - 1;
+		}
+		else if (c >= p->base + p->owner->size * SLAB_PAGE_OBJECTS) {
+			lo = mid + 1;
+		}
+		else {
+			return p;
+		}
+	}
+	return NULL;
+}
+#endif
+
+void* slab_alloc(slab* s) {
+	s->allocs++;
+#if defined(LISPR_SYSTEM_ALLOC)
+	return malloc(s->size);
+#elif defined(LISPR_GC)
+	if (++gc_allocs >= gc_threshold) lval_gc_collect();
+
+	slab_page* p = s->current;
+	if (!p || !p->free) {
+		// Look for another page of this slab with room before adding one
+		p = NULL;
+		for (int i = 0; i < gc_page_count; i++) {
+			if (gc_pages[i]->owner == s && gc_pages[i]->free) {
+				p = gc_pages[i];
+				break;
+			}
+		}
+		if (!p) p = slab_new_page(s);
+		s->current = p;
+	}
+	void** obj = p->free;
+	p->free = *obj;
+	p->nfree--;
+	p->live[((char*) obj - p->base) / s->size] = 1;
+	return obj;
+#else
+	if (!s->free) {
+		// Carve a new page into objects and thread them onto the free list
+		char* page = malloc(s->size * SLAB_PAGE_OBJECTS);
+		for (int i = SLAB_PAGE_OBJECTS-1; i >= 0; i--) {
+			void** obj = (void**) (page + i * s->size);
+			*obj = s->free;
+			s->free = obj;
+		}
+		s->pages++;
+	}
+	void** obj = s->free;
+	s->free = *obj;
+	return obj;
+#endif
+}
+
+void slab_free(slab* s, void* obj) {
+	s->frees++;
+#if defined(LISPR_SYSTEM_ALLOC)
+	free(obj);
+#elif defined(LISPR_GC)
+	slab_page* p = gc_find_page(obj);
+	p->live[((char*) obj - p->base) / s->size] = 0;
+	*(void**) obj = p->free;
+	p->free = obj;
+	p->nfree++;
+#else
+	*(void**) obj = s->free;
+	s->free = obj;
+#endif
+}
+
+lval* lval_alloc(void) {
+	return slab_alloc(&lval_slab);
+}
+
+void lval_free(lval* v) {
+	slab_free(&lval_slab, v);
+}
+
+lenv* lenv_alloc(void) {
+	return slab_alloc(&lenv_slab);
+}
+
+void lenv_free(lenv* e) {
+	slab_free(&lenv_slab, e);
+}
+
+#ifdef LISPR_GC
+// Objects found but not yet traced. Pointers to lenvs are tagged with
+// their low bit set.
+static void** gc_stack = NULL;
+static int gc_stack_count = 0;
+static int gc_stack_size = 0;
+
+void gc_mark(void* a) {
+	if (!a) return;
+	slab_page* p = gc_find_page(a);
+	if (!p) return;
+
+	// a may point into the middle of an object
+	int i = ((char*) a - p->base) / p->owner->size;
+	if (!p->live[i] || p->mark[i]) return;
+	p->mark[i] = 1;
+
+	if (gc_stack_count == gc_stack_size) {
+		gc_stack_size = gc_stack_size ? gc_stack_size * 2 : 1024;
+		gc_stack = realloc(gc_stack, sizeof(void*) * gc_stack_size);
+	}
+	uintptr_t obj = (uintptr_t) (p->base + i * p->owner->size);
+	gc_stack[gc_stack_count++] = (void*) (p->owner == &lenv_slab ? obj | 1 : obj);
+}
+
+void gc_trace(void) {
+	while (gc_stack_count) {
+		uintptr_t obj = (uintptr_t) gc_stack[--gc_stack_count];
+		if (obj & 1) {
+			// The parent may be the only remaining reference to a caller's frame
+			lenv* e = (lenv*) (obj & ~(uintptr_t) 1);
+			gc_mark(e->par);
+			for (int i = 0; i < e->count; i++) gc_mark(e->vals[i]);
+			continue;
+		}
+
+		lval* v = (lval*) obj;
+		switch (v->type) {
+			case LVAL_FUN:
+				if (!v->builtin) {
+					gc_mark(v->env);
+					gc_mark(v->formals);
+					gc_mark(v->body);
+					for (lcode* c = v->code; c; c = c->unfolded) {
+						for (int i = 0; i < c->nconsts; i++) gc_mark(c->consts[i]);
+					}
+				}
+			break;
+			case LVAL_SEXPR:
+			case LVAL_QEXPR:
+				gc_mark(v->owner);
+				for (int i = 0; i < v->count; i++) gc_mark(v->cell[i]);
+			break;
+		}
+	}
+}
+
+// Release the storage an object owns outside its slab
+void gc_finalize(slab* s, void* obj) {
+	if (s == &lenv_slab) {
+		lenv* e = obj;
+		free(e->syms);
+		free(e->vals);
+		free(e->index);
+		return;
+	}
+
+	lval* v = obj;
+	switch (v->type) {
+		case LVAL_FUN: if (!v->builtin) lcode_del(v->code); break;
+		case LVAL_NUM: if (v->num.type == BIG) big_del(v->num.b); break;
+		case LVAL_ERR: free(v->err); break;
+		case LVAL_STR: free(v->str); break;
+		case LVAL_VEC: free(v->vd); break;
+		case LVAL_SEXPR:
+		case LVAL_QEXPR: if (!v->owner) free(v->cell - v->offset); break;
+	}
+}
+
+void gc_sweep(void) {
+	long live = 0;
+	for (int n = 0; n < gc_page_count; n++) {
+		slab_page* p = gc_pages[n];
+		for (int i = 0; i < SLAB_PAGE_OBJECTS; i++) {
+			if (!p->live[i]) continue;
+			if (p->mark[i]) {
+				p->mark[i] = 0;
+				live++;
+				continue;
+			}
+			void* obj = p->base + i * p->owner->size;
+			gc_finalize(p->owner, obj);
+			slab_free(p->owner, obj);
+		}
+	}
+
+	// Let the heap grow to twice what survived before collecting again
+	gc_threshold = live > GC_MIN_THRESHOLD ? live : GC_MIN_THRESHOLD;
+	gc_allocs = 0;
+}
+
+// Scan every word between this frame and the base of the stack. Kept out
+// of line so that lval_gc_collect's saved registers lie inside the range.
+__attribute__((noinline, no_sanitize_address)) void gc_mark_stack(void) {
+	void* top = NULL;
+	for (void** w = &top; w < gc_stack_base; w++) gc_mark(*w);
+}
+#endif
+
+void lval_gc_init(void* stack_base) {
+#ifdef LISPR_GC
+	gc_stack_base = stack_base;
+#endif
+}
+
+void lval_gc_collect(void) {
+#ifdef LISPR_GC
+	if (!gc_stack_base) return;
+	// Spill callee-saved registers so that pointers held only in registers
+	// are visible on the stack
+	__builtin_unwind_init();
+	gc_mark_stack();
+	gc_trace();
+	gc_sweep();
+	gc_collections++;
+#endif
+}
+
+void slab_print_stats(char* name, slab* s) {
+	printf("%s: %ld allocated, %ld freed, %ld live, %ld bytes in %ld pages\n",
+			name, s->allocs, s->frees, s->allocs - s->frees,
+			s->pages * SLAB_PAGE_OBJECTS * (long) s->size, s->pages);
+}
+
+lval* builtin_alloc_stats(lenv* e, lval* a) {
+	// Arguments are ignored; call as (alloc-stats ())
+	slab_print_stats("lval", &lval_slab);
+	slab_print_stats("lenv", &lenv_slab);
+	printf("lookup cache: %ld hits, %ld misses\n", lenv_cache_hits, lenv_cache_misses);
+	printf("fold: %ld calls folded\n", lval_folds);
+	printf("jit: %ld bodies compiled, %ld bytes\n", jit_compiled, jit_bytes);
+#ifdef LISPR_GC
+	printf("gc: %ld collections\n", gc_collections);
+#endif
+	lval_del(a);
+	return lval_sexpr();
+}
+
+// Booleans, nil and small integers are preallocated, so producing one
+// never touches the allocator
+static lval static_bools[2];
+static lval static_nil;
+static lval static_ints[SMALL_INT_MAX - SMALL_INT_MIN + 1];
+static int statics_ready = 0;
+
+void lval_init_statics(void) {
+	for (int b = FALSE; b <= TRUE; b++) {
+		static_bools[b].type = LVAL_BOOL;
+		static_bools[b].ref = LVAL_STATIC;
+		static_bools[b].bool = b;
+	}
+	static_nil.type = LVAL_QEXPR;
+	static_nil.ref = LVAL_STATIC;
+	static_nil.count = 0;
+	static_nil.size = 0;
+	static_nil.offset = 0;
+	static_nil.cell = NULL;
+	static_nil.owner = NULL;
+	for (long l = SMALL_INT_MIN; l <= SMALL_INT_MAX; l++) {
+		lval* v = &static_ints[l - SMALL_INT_MIN];
+		v->type = LVAL_NUM;
+		v->ref = LVAL_STATIC;
+		v->num.type = LONG;
+		v->num.l = l;
+	}
+	statics_ready = 1;
+}
 
 lval* lval_num(Num x) {
-	lval* v = malloc(sizeof(lval));
+	if (x.type == LONG && x.l >= SMALL_INT_MIN && x.l <= SMALL_INT_MAX) {
+		if (!statics_ready) lval_init_statics();
+		return &static_ints[x.l - SMALL_INT_MIN];
+	}
+
+	lval* v = lval_alloc();
 	v->type = LVAL_NUM;
+	v->ref = 1;
 	v->num = x;
 	return v;
 }
 
 lval* lval_err(char* fmt, ...) {
-	lval* v = malloc(sizeof(lval));
+	lval* v = lval_alloc();
 	v->type = LVAL_ERR;
+	v->ref = 1;
     
     // create and initialize a va list
     va_list va;
@@ -24,69 +401,158 @@ lval* lval_err(char* fmt, ...) {
 }
 
 lval* lval_sym(char* s) {
-    lval* v = malloc(sizeof(lval));
+    lval* v = lval_alloc();
     v->type = LVAL_SYM;
-    v->sym = malloc(strlen(s)+1);
-    strcpy(v->sym, s);
+    v->ref = 1;
+    v->sym = lval_intern(s);
     return v;
 }
 
+// Process-wide symbol table. Every symbol name is stored exactly once, so
+// symbols can be compared and hashed by pointer. Names are never freed.
+static char** interned = NULL;
+static int interned_count = 0;
+static int interned_size = 0;
+
+char* sym_amp;
+char* sym_def;
+char* sym_if;
+char* sym_and;
+char* sym_or;
+
+// FNV-1a hash of a symbol name
+unsigned intern_hash(char* s) {
+	unsigned h = 2166136261u;
+	while (*s) {
+		h ^= (unsigned char) *s++;
+		h *= 16777619u;
+	}
+	return h;
+}
+
+char* lval_intern(char* s) {
+	if (interned_size == 0) {
+		interned_size = 256;
+		interned = calloc(interned_size, sizeof(char*));
+		sym_amp = lval_intern("&");
+		sym_def = lval_intern("def");
+		sym_if = lval_intern("if");
+		sym_and = lval_intern("&&");
+		sym_or = lval_intern("||");
+	}
+
+	unsigned mask = interned_size - 1;
+	unsigned h = intern_hash(s) & mask;
+	while (interned[h]) {
+		if (strcmp(interned[h], s) == 0) return interned[h];
+		h = (h+1) & mask;
+	}
+
+	char* name = malloc(strlen(s)+1);
+	strcpy(name, s);
+	interned[h] = name;
+	interned_count++;
+
+	// Keep the table at most half full
+	if (interned_count * 2 > interned_size) {
+		char** old = interned;
+		int old_size = interned_size;
+		interned_size *= 2;
+		interned = calloc(interned_size, sizeof(char*));
+		mask = interned_size - 1;
+		for (int i = 0; i < old_size; i++) {
+			if (!old[i]) continue;
+			h = intern_hash(old[i]) & mask;
+			while (interned[h]) h = (h+1) & mask;
+			interned[h] = old[i];
+		}
+		free(old);
+	}
+	return name;
+}
+
 lval* lval_str(char* s) {
-	lval* v = malloc(sizeof(lval));
+	lval* v = lval_alloc();
 	v->type = LVAL_STR;
+	v->ref = 1;
 	v->str = malloc(strlen(s)+1);
 	strcpy(v->str, s);
 	return v;
 }
 
 lval* lval_sexpr(void) {
-    lval* v = malloc(sizeof(lval));
+    lval* v = lval_alloc();
     v->type = LVAL_SEXPR;
+    v->ref = 1;
     v->count = 0;
+    v->size = 0;
+    v->offset = 0;
     v->cell = NULL;
+    v->owner = NULL;
     return v;
 }
 
 lval* lval_qexpr(void) {
-    lval* v = malloc(sizeof(lval));
+    lval* v = lval_alloc();
     v->type = LVAL_QEXPR;
+    v->ref = 1;
     v->count = 0;
+    v->size = 0;
+    v->offset = 0;
     v->cell = NULL;
+    v->owner = NULL;
     return v;
 }
 
 lval* lval_bool(int b) {
-	lval* v = malloc(sizeof(lval));
-	v->type = LVAL_BOOL;
-	v->bool = b;
-	return v;
+	if (!statics_ready) lval_init_statics();
+	return &static_bools[b ? TRUE : FALSE];
+}
+
+// The empty q-expression. Like any shared list it is copied before being
+// changed (see lval_own).
+lval* lval_nil(void) {
+	if (!statics_ready) lval_init_statics();
+	return &static_nil;
 }
 
 void lval_del(lval* v) {
-    
+#ifdef LISPR_GC
+    // Unreachable values are reclaimed by lval_gc_collect
+    return;
+#endif
+    // Only the last owner actually frees the value
+    if (v->ref == LVAL_STATIC || --v->ref > 0) return;
+
     switch (v->type) {
-        case LVAL_NUM: break;
+        case LVAL_NUM: if (v->num.type == BIG) big_del(v->num.b); break;
         case LVAL_FUN:
 						if (!v->builtin) {
-							lenv_del(v->env);
+							if (v->env) lenv_del(v->env);
 							lval_del(v->formals);
 							lval_del(v->body);
+							lcode_del(v->code);
 						}
 				break;
         case LVAL_ERR: free(v->err); break;
-        case LVAL_SYM: free(v->sym); break;
+        case LVAL_SYM: break;
 				case LVAL_STR: free(v->str); break;
+				case LVAL_VEC: free(v->vd); break;
         case LVAL_SEXPR:
         case LVAL_QEXPR:
+            if (v->owner) {
+                lval_del(v->owner);
+                break;
+            }
             for (int i = 0; i < v->count; i++) {
                 lval_del(v->cell[i]);
             }
-            free(v->cell);
+            free(v->cell - v->offset);
 				break;
 				case LVAL_BOOL: break;
     }
     
-    free(v);
+    lval_free(v);
 }
 
 lval* lval_read_num(mpc_ast_t* t) {
@@ -100,6 +566,12 @@ lval* lval_read_num(mpc_ast_t* t) {
             n.l = x;
             return lval_num(n);
         }
+
+        // Too big for a long
+        Num n;
+        n.type = BIG;
+        n.b = big_from_str(t->contents);
+        return lval_num(n);
     }
     
     else if (strstr(t->tag, "double")) {
@@ -137,7 +609,11 @@ lval* lval_read(mpc_ast_t* t) {
 				if (strstr(t->children[i]->tag, "comment")) continue;
         x = lval_add(x, lval_read(t->children[i]));
     }
-    
+
+    if (x->type == LVAL_QEXPR && x->count == 0) {
+        lval_del(x);
+        return lval_nil();
+    }
     return x;
 }
 
@@ -155,10 +631,482 @@ lval* lval_read_str(mpc_ast_t* t) {
 	return str;
 }
 
+// Reader. Builds lvals straight from source text, following the grammar
+// prompt.c gives to mpc. mpc is only used to report syntax errors, by
+// parsing the input again when the reader fails.
+
+// Skips whitespace and comments
+void lval_read_space(char** p) {
+	char* s = *p;
+	while (1) {
+		if (*s && strchr(" \t\n\r\v\f", *s)) s++;
+		else if (*s == ';') while (*s && *s != '\n' && *s != '\r') s++;
+		else break;
+	}
+	*p = s;
+}
+
+int lval_is_symbol_char(char c) {
+	return isalnum((unsigned char) c) || (c && strchr("_+-*/\\=<>!&%^|", c));
+}
+
+// Number or symbol made from the len characters at s
+lval* lval_read_token(char* s, int len, int type) {
+	char buf[64];
+	char* t = len < 64 ? buf : malloc(len + 1);
+	memcpy(t, s, len);
+	t[len] = '\0';
+
+	lval* x;
+	Num n;
+	errno = 0;
+	switch (type) {
+		case LONG:
+			n.type = LONG;
+			n.l = strtol(t, NULL, 10);
+			// Too big for a long
+			if (errno == ERANGE) {
+				n.type = BIG;
+				n.b = big_from_str(t);
+			}
+			x = lval_num(n);
+		break;
+		case DOUBLE:
+			n.type = DOUBLE;
+			n.d = strtod(t, NULL);
+			x = errno == ERANGE ? lval_err("invalid number %s", t) : lval_num(n);
+		break;
+		default: x = lval_sym(t); break;
+	}
+
+	if (t != buf) free(t);
+	return x;
+}
+
+// String literal at *p, with C escapes. Returns NULL, with *p at the end
+// of the input, if it isn't closed.
+lval* lval_read_string(char** p) {
+	char* s = *p + 1;
+	char* end = s;
+	while (*end && *end != '"') end += end[0] == '\\' && end[1] ? 2 : 1;
+	if (!*end) {
+		*p = end;
+		return NULL;
+	}
+
+	// Unescaping only ever shortens the string
+	char* str = malloc(end - s + 1);
+	char* o = str;
+	while (s < end) {
+		char* c = s[0] == '\\' ? strchr("abfnrtv\\'\"0", s[1]) : NULL;
+		if (c) {
+			*o++ = "\a\b\f\n\r\t\v\\'\"\0"[c - "abfnrtv\\'\"0"];
+			s += 2;
+		}
+		else *o++ = *s++;
+	}
+	*o = '\0';
+
+	lval* x = lval_alloc();
+	x->type = LVAL_STR;
+	x->ref = 1;
+	x->str = str;
+	*p = end + 1;
+	return x;
+}
+
+// Reads one expression from *p and moves *p past it. Returns NULL on a
+// syntax error, with *p where the error is.
+lval* lval_read_expr(char** p) {
+	char* s = *p;
+	lval* x;
+
+	// Numbers are tried before symbols, which can contain digits
+	char* d = s + (*s == '-');
+	if (isdigit((unsigned char) *d)) {
+		while (isdigit((unsigned char) *d)) d++;
+		int type = LONG;
+		if (*d == '.') {
+			type = DOUBLE;
+			for (d++; isdigit((unsigned char) *d); d++);
+		}
+		x = lval_read_token(s, d - s, type);
+		s = d;
+	}
+	else if (lval_is_symbol_char(*s)) {
+		for (d = s; lval_is_symbol_char(*d); d++);
+		x = lval_read_token(s, d - s, LVAL_SYM);
+		s = d;
+	}
+	else if (*s == '"') {
+		x = lval_read_string(&s);
+		if (!x) {
+			*p = s;
+			return NULL;
+		}
+	}
+	else if (*s == '(' || *s == '{') {
+		char close = *s == '(' ? ')' : '}';
+		x = *s == '(' ? lval_sexpr() : lval_qexpr();
+		s++;
+		while (1) {
+			lval_read_space(&s);
+			if (*s == close) break;
+			lval* y = *s ? lval_read_expr(&s) : NULL;
+			if (!y) {
+				lval_del(x);
+				*p = s;
+				return NULL;
+			}
+			lval_add(x, y);
+		}
+		s++;
+		if (close == '}' && x->count == 0) {
+			lval_del(x);
+			x = lval_nil();
+		}
+	}
+	else return NULL;
+
+	*p = s;
+	return x;
+}
+
+// All the expressions in s, as an s-expression. Returns NULL on a syntax
+// error.
+lval* lval_read_src(char* s) {
+	lval* x = lval_sexpr();
+	while (1) {
+		lval_read_space(&s);
+		if (!*s) return x;
+		lval* y = lval_read_expr(&s);
+		if (!y) {
+			lval_del(x);
+			return NULL;
+		}
+		lval_add(x, y);
+	}
+}
+
+// Source read a top-level form at a time, so that only the form being
+// read needs to be in memory. A form that runs past the end of the
+// buffer is read again once more of the file is in.
+//
+// Regular files are mapped instead, and read in place; the pages of what
+// has been read are unmapped as the reader goes. Pipes, and files whose
+// size is a multiple of the page size (which leaves no zero byte after
+// the mapping to end it), are read through the buffer.
+void lreader_init(lreader* r, FILE* f) {
+	r->file = f;
+	r->start = 0;
+	r->row = 0;
+	r->col = 0;
+	r->mapped = 0;
+	r->unmapped = 0;
+
+#ifdef LISPR_MMAP
+	struct stat st;
+	long page = sysconf(_SC_PAGESIZE);
+	if (fstat(fileno(f), &st) == 0 && S_ISREG(st.st_mode) && st.st_size > 0 &&
+			st.st_size % page != 0) {
+		void* map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fileno(f), 0);
+		if (map != MAP_FAILED) {
+			posix_madvise(map, st.st_size, POSIX_MADV_SEQUENTIAL);
+			r->buf = map;
+			r->size = st.st_size;
+			r->len = st.st_size;
+			r->eof = 1;
+			r->mapped = 1;
+			return;
+		}
+	}
+#endif
+
+	r->size = LREADER_CHUNK;
+	r->buf = malloc(r->size);
+	r->buf[0] = '\0';
+	r->len = 0;
+	r->eof = 0;
+}
+
+void lreader_free(lreader* r) {
+#ifdef LISPR_MMAP
+	if (r->mapped) {
+		munmap(r->buf + r->unmapped, r->len - r->unmapped);
+		return;
+	}
+#endif
+	free(r->buf);
+}
+
+// Drops what has been read and reads more. The buffer doubles whenever
+// unread data fills half of it, so a long form is re-read only a
+// logarithmic number of times.
+void lreader_fill(lreader* r) {
+	long left = r->len - r->start;
+	memmove(r->buf, r->buf + r->start, left);
+	r->start = 0;
+	r->len = left;
+	if (left >= r->size / 2) {
+		r->size *= 2;
+		r->buf = realloc(r->buf, r->size);
+	}
+	r->len += fread(r->buf + left, 1, r->size - 1 - left, r->file);
+	r->buf[r->len] = '\0';
+	if (feof(r->file) || ferror(r->file)) r->eof = 1;
+}
+
+// Marks everything before to as read, keeping track of the position
+void lreader_skip(lreader* r, char* to) {
+	char* c = r->buf + r->start;
+	char* nl;
+	while ((nl = memchr(c, '\n', to - c))) {
+		r->row++;
+		r->col = 0;
+		c = nl + 1;
+	}
+	r->col += to - c;
+	r->start = to - r->buf;
+
+#ifdef LISPR_MMAP
+	// Give back the pages that have been read every LREADER_UNMAP bytes
+	if (r->mapped && r->start - r->unmapped >= LREADER_UNMAP) {
+		long page = sysconf(_SC_PAGESIZE);
+		long end = r->start / page * page;
+		munmap(r->buf + r->unmapped, end - r->unmapped);
+		r->unmapped = end;
+	}
+#endif
+}
+
+// Reads the next form into *x. Returns 1 if there was one, 0 at the end of
+// the input, and -1 on a syntax error, with *x the error.
+int lreader_next(lreader* r, char* name, lval** x) {
+	while (1) {
+		char* s = r->buf + r->start;
+		char* end = r->buf + r->len;
+		lval_read_space(&s);
+		if (s == end && r->eof) {
+			lreader_skip(r, s);
+			return 0;
+		}
+
+		lval* y = s < end ? lval_read_expr(&s) : NULL;
+		// Anything up to the end of the buffer may go on in the file
+		if (s == end && !r->eof) {
+			if (y) lval_del(y);
+			lreader_fill(r);
+			continue;
+		}
+
+		if (y) {
+			lreader_skip(r, s);
+			*x = y;
+			return 1;
+		}
+
+		// Let mpc report what is wrong, then move its position by where
+		// the form starts
+		mpc_result_t res;
+		if (mpc_parse(name, r->buf + r->start, Lispr, &res)) {
+			mpc_ast_delete(res.output);
+			*x = lval_err("Could not load library %s:%ld:%ld: error: unexpected "
+					"'%c'", name, r->row + 1, r->col + 1, *s);
+			return -1;
+		}
+		if (res.error->state.row == 0) res.error->state.col += r->col;
+		res.error->state.row += r->row;
+		char* err_msg = mpc_err_string(res.error);
+		mpc_err_delete(res.error);
+		*x = lval_err("Could not load library %s", err_msg);
+		free(err_msg);
+		return -1;
+	}
+}
+
+// Constant folding. Calls of pure builtins on literal numbers, strings and
+// booleans are replaced by their results, working from the innermost
+// calls out, so (* 60 60 24) in a lambda body is worked out once rather
+// than on every call. Only code is folded: a form as it is read, a lambda
+// body as the lambda is made (once its formals are shadowed) and the
+// branches of if. Other q-expressions are data and are left alone. A call
+// is only folded while its symbol is bound to the builtin globally and has
+// never been bound anywhere else (see lenv_shadow), and a call that would
+// fail is left for evaluation to report.
+//
+// A form is evaluated as soon as it is folded, so nothing can rebind its
+// builtins in between. A lambda body is run long after, by when a caller
+// may bind one of them (scoping is dynamic), so the symbols its folds
+// relied on are collected in lval_fold_syms and kept with its code; see
+// lcode_current.
+int lval_fold_enabled = TRUE;
+long lval_folds = 0;
+char** lval_fold_syms = NULL;
+int lval_fold_nsyms = 0;
+static int lval_fold_syms_size = 0;
+
+// Notes that a fold relied on sym being bound only globally
+void lval_fold_sym(char* sym) {
+	for (int i = 0; i < lval_fold_nsyms; i++) {
+		if (lval_fold_syms[i] == sym) return;
+	}
+	if (lval_fold_nsyms == lval_fold_syms_size) {
+		lval_fold_syms_size = lval_fold_syms_size ? lval_fold_syms_size * 2 : 8;
+		lval_fold_syms = realloc(lval_fold_syms, sizeof(char*) * lval_fold_syms_size);
+	}
+	lval_fold_syms[lval_fold_nsyms++] = sym;
+}
+
+int lval_fold_pure(lbuiltin f) {
+	return f == builtin_add || f == builtin_sub || f == builtin_mul ||
+		f == builtin_div || f == builtin_mod || f == builtin_exp ||
+		f == builtin_eq || f == builtin_ne ||
+		f == builtin_greater_than || f == builtin_smaller_than ||
+		f == builtin_greater_than_or_equal_to ||
+		f == builtin_smaller_than_or_equal_to ||
+		f == builtin_and || f == builtin_or || f == builtin_not;
+}
+
+// The builtin sym is bound to, if it is bound only globally
+lbuiltin lval_fold_builtin(lenv* e, lval* sym) {
+	if (sym->type != LVAL_SYM || lenv_shadowed(sym->sym)) return NULL;
+	lval* f = lenv_get(e, sym);
+	lbuiltin b = f->type == LVAL_FUN ? f->builtin : NULL;
+	lval_del(f);
+	return b;
+}
+
+// Replaces cell i of v with x, copying v first if it is shared
+lval* lval_fold_set(lval* v, int i, lval* x) {
+	v = lval_own(v);
+	lval_del(v->cell[i]);
+	v->cell[i] = x;
+	return v;
+}
+
+// Folds the code in v, a call written as an s-expression or a q-expression
+// to be evaluated as one: its s-expression cells, and the branches if it
+// calls if. Takes v and returns it, or a copy if v is shared and something
+// in it changed.
+lval* lval_fold_code(lenv* e, lval* v) {
+	for (int i = 0; i < v->count; i++) {
+		if (v->cell[i]->type != LVAL_SEXPR) continue;
+		lval* c = v->cell[i];
+		lval* x = lval_fold(e, lval_ref(c));
+		if (x == c) lval_del(x);
+		else v = lval_fold_set(v, i, x);
+	}
+	if (v->count == 4 && lval_fold_builtin(e, v->cell[0]) == builtin_if) {
+		for (int i = 2; i < 4; i++) {
+			if (v->cell[i]->type != LVAL_QEXPR) continue;
+			lval* c = v->cell[i];
+			lval* x = lval_fold_code(e, lval_ref(c));
+			if (x == c) lval_del(x);
+			else {
+				v = lval_fold_set(v, i, x);
+				lval_fold_sym(v->cell[0]->sym);
+			}
+		}
+	}
+	return v;
+}
+
+// Folds the form v, taking it and returning it, its value or (if v is
+// shared) a folded copy
+lval* lval_fold(lenv* e, lval* v) {
+	if (v->type != LVAL_SEXPR) return v;
+	v = lval_fold_code(e, v);
+	if (v->count < 2) return v;
+	for (int i = 1; i < v->count; i++) {
+		int t = v->cell[i]->type;
+		if (t != LVAL_NUM && t != LVAL_STR && t != LVAL_BOOL) return v;
+	}
+
+	lbuiltin f = lval_fold_builtin(e, v->cell[0]);
+	if (!f || !lval_fold_pure(f)) return v;
+	lval* a = lval_sexpr();
+	for (int i = 1; i < v->count; i++) a = lval_add(a, lval_ref(v->cell[i]));
+	lval* x = f(e, a);
+	if (x->type == LVAL_ERR) {
+		lval_del(x);
+		return v;
+	}
+	lval_fold_sym(v->cell[0]->sym);
+	lval_del(v);
+	lval_folds++;
+	return x;
+}
+
+// View of count cells of list v starting at from. v's array is shared, so
+// this takes no copies; v is kept alive (and so unmodified) by the view.
+lval* lval_slice(lval* v, int from, int count) {
+    lval* x = lval_alloc();
+    x->type = v->type;
+    x->ref = 1;
+    x->count = count;
+    x->size = 0;
+    x->offset = 0;
+    x->cell = v->cell + from;
+    x->owner = lval_ref(v->owner ? v->owner : v);
+    return x;
+}
+
+// Give a view its own copy of the cells it shares
+void lval_unshare(lval* v) {
+    lval* owner = v->owner;
+    lval** cell = malloc(sizeof(lval*) * v->count);
+    for (int i = 0; i < v->count; i++) {
+        cell[i] = lval_ref(v->cell[i]);
+    }
+    v->cell = cell;
+    v->size = v->count;
+    v->offset = 0;
+    v->owner = NULL;
+    lval_del(owner);
+}
+
+// Make room for at least n cells in v
+void lval_reserve(lval* v, int n) {
+    if (v->offset + n <= v->size) return;
+    lval** base = v->cell - v->offset;
+
+    // Space freed at the front is reused once it is at least half the
+    // array, so the move is paid for by the pops that freed it
+    if (v->offset && v->offset >= v->size / 2 && n <= v->size) {
+        memmove(base, v->cell, sizeof(lval*) * v->count);
+        v->cell = base;
+        v->offset = 0;
+        return;
+    }
+
+    // Otherwise grow geometrically
+    int size = v->size ? v->size * 2 : 4;
+    while (size < v->offset + n) size *= 2;
+    base = realloc(base, sizeof(lval*) * size);
+    v->cell = base + v->offset;
+    v->size = size;
+}
+
+// Make room for n more cells in front of v's first
+void lval_reserve_front(lval* v, int n) {
+    if (v->offset >= n) return;
+
+    // Leave at least as much room again as there are cells, so repeated
+    // prepends don't move the cells every time
+    int front = n > v->count ? n : v->count;
+    int size = front + v->count;
+    lval** cell = malloc(sizeof(lval*) * size);
+    memcpy(cell + front, v->cell, sizeof(lval*) * v->count);
+    free(v->cell - v->offset);
+    v->cell = cell + front;
+    v->size = size;
+    v->offset = front;
+}
+
 lval* lval_add(lval* v, lval* x) {
-    v->count++;
-    v->cell = realloc(v->cell, sizeof(lval*) * v->count);
-    v->cell[v->count-1] = x;
+    if (v->owner) lval_unshare(v);
+    lval_reserve(v, v->count + 1);
+    v->cell[v->count++] = x;
     return v;
 }
 
@@ -185,6 +1133,9 @@ void lval_print(lenv* e, lval* v) {
 					case DOUBLE:
 							printf("%f", v->num.d);
 					break;
+					case BIG:
+							big_print(v->num.b);
+					break;
 			}
 		break;
 		case LVAL_ERR:
@@ -202,12 +1153,25 @@ void lval_print(lenv* e, lval* v) {
 		case LVAL_QEXPR:
 			lval_expr_print(e, v, '{', '}');
 		break;
+		case LVAL_VEC:
+			putchar('[');
+			for (int i = 0; i < v->len; i++) {
+				if (i) putchar(' ');
+				if (v->vtype == LONG) printf("%ld", v->vl[i]);
+				else printf("%f", v->vd[i]);
+			}
+			putchar(']');
+		break;
 		case LVAL_FUN:
 			if (v->builtin) {
 				printf("<builtin>");
 			}
 			else {
-				printf("(\\ "); lval_print(e,v->formals);
+				// Only the formals still to be bound are shown
+				lval rest = *v->formals;
+				rest.count -= v->bound;
+				rest.cell += v->bound;
+				printf("(\\ "); lval_print(e,&rest);
 				putchar(' '); lval_print(e,v->body); putchar(')');
 			}
 		break;
@@ -238,63 +1202,238 @@ void lval_println(lenv* e, lval* v) {
 }
 
 lval* lval_eval_sexpr(lenv* e, lval* v) {
-	// Before evaluating an s-expression, we need to evaluate each of its
-	// components
-	for (int i = 0; i < v->count; i++) {
-		v->cell[i] = lval_eval(e,v->cell[i]);
-		if (v->cell[i]->type == LVAL_ERR) return lval_take(v,i);
-	}
-
-	// If the sexpr is empty, we can just return it
-	if (v->count == 0) return v;
-	// If it has one component, we can evaulate it and return it
-	if (v->count == 1) return lval_eval(e,lval_take(v,0));
-
-	lval* f = lval_pop(v,0);
-	if (f->type != LVAL_FUN) {
-		lval* err = lval_err("S-expression starts with incorrect type. "
-				"Got %s, expected %s.", ltype_name(f->type), ltype_name(LVAL_FUN));
-		lval_del(f); lval_del(v);
-		return err;
-	}
-
-	lval* result = lval_call(e,f,v);
-	lval_del(f);
-	return result;
+	return lval_eval(e, v);
 }
 
 lval* lval_eval(lenv* e, lval* v) {
-    if (v->type == LVAL_SYM) {
-        lval* x = lenv_get(e, v);
-        lval_del(v);
-        return x;
-    }
-    // Evaluate S-Expressions
-    if (v->type == LVAL_SEXPR) return lval_eval_sexpr(e, v);
-    // All other lval types are returned as is
-    return v;
+	return lval_apply(e, NULL, v);
 }
 
-lval* lval_pop(lval* v, int i) {
-    // Find the item at i
-    lval* x = v->cell[i];
-    
-    // Shift memory after item i
-    memmove(&v->cell[i], &v->cell[i+1],
-            sizeof(lval*) * (v->count-i-1));
-    
-    // Decrease item count
-    v->count--;
-    
-    // Reallocate used memory
-    v->cell = realloc(v->cell, sizeof(lval*) * v->count);
-    return x;
-}
+lval* lval_apply(lenv* e, lval* f, lval* v) {
+	// Calls in tail position don't recurse: the loop carries on with the
+	// callee's body in place of v. fn is the lambda being run, if any, and
+	// frame the environment this loop made for it (and e); both are
+	// released once we leave them.
+	lval* fn = NULL;
+	lenv* frame = NULL;
+	lval* result;
+	// v is a body or branch: a q-expression to evaluate as an s-expression
+	int code = FALSE;
 
-lval* lval_take(lval* v, int i) {
-    lval* x = lval_pop(v, i);
-    lval_del(v);
-    return x;
+	while (1) {
+		if (!f) {
+			if (v->type == LVAL_SYM) {
+				result = lenv_get(e, v);
+				lval_del(v);
+				break;
+			}
+			// All other lval types except S-Expressions are returned as is
+			if (v->type != LVAL_SEXPR && !(code && v->type == LVAL_QEXPR)) {
+				result = v;
+				break;
+			}
+
+			// if with literal branches is a special form: only the condition
+			// and the chosen branch are evaluated, and the branch goes on as
+			// it is, without being copied out of v
+			if (lval_is_if(e, v)) {
+				lval* cond = lval_eval(e, lval_ref(v->cell[1]));
+				if (cond->type != LVAL_BOOL) {
+					// An error, or one for lval_if_branch to report
+					lval* a = cond->type == LVAL_ERR ? NULL : lval_add(lval_add(
+								lval_add(lval_sexpr(), cond), lval_ref(v->cell[2])),
+							lval_ref(v->cell[3]));
+					result = a ? lval_if_branch(a) : cond;
+					lval_del(v);
+					break;
+				}
+				lval* branch = lval_ref(v->cell[cond->bool ? 2 : 3]);
+				lval_del(cond);
+				lval_del(v);
+				v = branch;
+				code = TRUE;
+				continue;
+			}
+
+			// An expression of one cell is just that cell, evaluated in tail
+			// position, so ((f x)) and a body {(f x)} run through eval are
+			// tail calls
+			if (v->count == 1) {
+				lval* x = lval_ref(v->cell[0]);
+				lval_del(v);
+				v = x;
+				code = FALSE;
+				continue;
+			}
+
+			// Cells are replaced in place, so v may not be shared (it is usually
+			// a function body)
+			v = lval_own(v);
+			v->type = LVAL_SEXPR;
+			code = FALSE;
+
+			// Before evaluating an s-expression, we need to evaluate each of its
+			// components
+			int failed = -1;
+			int junction = FALSE;
+			for (int i = 0; i < v->count; i++) {
+				v->cell[i] = lval_eval(e,v->cell[i]);
+				if (v->cell[i]->type == LVAL_ERR) {
+					failed = i;
+					break;
+				}
+				// && and || evaluate their operands themselves
+				if (i == 0 && v->count > 2 && lval_is_junction(v->cell[0])) {
+					junction = TRUE;
+					break;
+				}
+			}
+			if (failed >= 0) {
+				result = lval_take(v,failed);
+				break;
+			}
+			if (junction) {
+				result = lval_junction(e, v);
+				break;
+			}
+
+			// If the sexpr is empty, we can just return it
+			if (v->count == 0) {
+				result = v;
+				break;
+			}
+			f = lval_pop(v,0);
+		}
+
+		// Apply f to the evaluated arguments in v
+		if (f->type != LVAL_FUN) {
+			result = lval_err("S-expression starts with incorrect type. "
+					"Got %s, expected %s.", ltype_name(f->type), ltype_name(LVAL_FUN));
+			lval_del(f); lval_del(v);
+			break;
+		}
+
+		// if and eval continue with the expression they would evaluate
+		if (f->builtin == builtin_if || f->builtin == builtin_eval) {
+			v = f->builtin == builtin_if ? lval_if_branch(v) : lval_eval_arg(v);
+			lval_del(f);
+			f = NULL;
+			continue;
+		}
+		if (f->builtin) {
+			result = f->builtin(e,v);
+			lval_del(f);
+			break;
+		}
+
+		lenv* next;
+		lval* partial = lval_bind(e,f,v,&next);
+		if (partial) {
+			result = partial;
+			lval_del(f);
+			break;
+		}
+
+		// Tail call. The current frame is finished with, so rather than
+		// chaining the new frame onto it, the new frame takes over its
+		// bindings (those it doesn't shadow) and its parent. That keeps the
+		// environment chain from growing in tail-recursive loops.
+		if (frame) {
+			lenv_inherit(next, frame);
+			next->par = frame->par;
+			lenv_del(frame);
+		}
+		else {
+			next->par = e;
+		}
+		frame = next;
+		e = next;
+		if (fn) lval_del(fn);
+		fn = f;
+		f = NULL;
+
+		// Compiled bodies run on the VM, which hands back its own tail call
+		// (if any) as a function and arguments to apply
+		if (fn->code) {
+			result = vm_run(e, lcode_current(fn), &f, &v);
+			if (f) continue;
+			break;
+		}
+		v = lval_ref(fn->body);
+		code = TRUE;
+	}
+
+	if (frame) lenv_del(frame);
+	if (fn) lval_del(fn);
+	return result;
+}
+
+lval* lval_pop(lval* v, int i) {
+    // Find the item at i
+    lval* x = v->cell[i];
+    
+    // A view only gives up its reference to the first item, since the array
+    // isn't its own
+    if (v->owner) {
+        if (i == 0) {
+            v->cell++;
+            v->count--;
+            return lval_ref(x);
+        }
+        lval_unshare(v);
+    }
+
+    // The first item is dropped by moving the start of the array; anything
+    // else by shifting memory after it. The space isn't given back.
+    if (i == 0) {
+        v->cell++;
+        v->offset++;
+    }
+    else {
+        memmove(&v->cell[i], &v->cell[i+1],
+                sizeof(lval*) * (v->count-i-1));
+    }
+    
+    // Decrease item count
+    v->count--;
+    return x;
+}
+
+lval* lval_take(lval* v, int i) {
+    // A shared list (or a view of one) is left intact; we only need another
+    // reference to x
+    if (v->ref > 1 || v->owner) {
+        lval* x = lval_ref(v->cell[i]);
+        lval_del(v);
+        return x;
+    }
+    lval* x = lval_pop(v, i);
+    lval_del(v);
+    return x;
+}
+
+lval* lval_ref(lval* v) {
+#ifdef LISPR_GC
+    // Owners are never released, so only record that v is now shared
+    if (v->ref == 1) v->ref = 2;
+#else
+    if (v->ref != LVAL_STATIC) v->ref++;
+#endif
+    return v;
+}
+
+lval* lval_own(lval* v) {
+    // Values with a single owner can be mutated directly; otherwise the
+    // caller gets a private copy and gives up its reference to v
+    if (v->ref == 1) {
+        if ((v->type == LVAL_SEXPR || v->type == LVAL_QEXPR) && v->owner) {
+            lval_unshare(v);
+        }
+        return v;
+    }
+    lval* x = lval_copy(v);
+    lval_del(v);
+    return x;
 }
 
 lval* builtin_head(lenv* e, lval* a) {
@@ -312,9 +1451,9 @@ lval* builtin_head(lenv* e, lval* a) {
 		lval* v;
 		if (first_type == LVAL_QEXPR) {
 			CHECK_EMPTY(a, "Function 'head' passed {}!");
-			v = lval_take(a, 0);
-			// Delete all other element and return v
-			while (v->count > 1) lval_del(lval_pop(v, 1));
+			lval* l = lval_take(a, 0);
+			v = lval_add(lval_qexpr(), lval_ref(l->cell[0]));
+			lval_del(l);
 		}
 		else {
 			char* str = malloc(2);
@@ -344,9 +1483,17 @@ lval* builtin_tail(lenv* e, lval* a) {
 		if (first_type == LVAL_QEXPR) {
 			CHECK_EMPTY(a, "Function 'tail' passed {}!");
 			// a is a q-expression. We assign its contents to v, and then delete
-			// the first element
+			// the first element. A shared list isn't copied; the tail is a view
+			// of it.
 			v = lval_take(a, 0);
-			lval_del(lval_pop(v, 0));
+			if (v->ref > 1) {
+				lval* l = v;
+				v = lval_slice(l, 1, l->count-1);
+				lval_del(l);
+			}
+			else {
+				lval_del(lval_pop(v, 0));
+			}
 		}
 		else {
 			char* str = malloc(strlen(a->cell[0]->str));
@@ -366,11 +1513,15 @@ lval* builtin_list(lenv* e, lval* a) {
 }
 
 lval* builtin_eval(lenv* e, lval* a) {
+    return lval_eval(e, lval_eval_arg(a));
+}
+
+lval* lval_eval_arg(lval* a) {
 		CHECK_COUNT("eval", a, 1);
 		CHECK_INPUT_TYPE("eval", a, 0, LVAL_QEXPR);
-    lval* x = lval_take(a,0);
+    lval* x = lval_own(lval_take(a,0));
     x->type = LVAL_SEXPR;
-    return lval_eval(e,x);
+    return x;
 }
 
 lval* builtin_join(lenv* e, lval* a) {
@@ -398,7 +1549,7 @@ lval* builtin_join(lenv* e, lval* a) {
      
 		lval* x;
 		if (first_type == LVAL_QEXPR) {
-			x = lval_pop(a,0);
+			x = lval_own(lval_pop(a,0));
 			while (a->count) {
 					x = lval_join(x, lval_pop(a,0));
 			}
@@ -418,9 +1569,26 @@ lval* builtin_join(lenv* e, lval* a) {
 }
 
 lval* lval_join(lval* x, lval* y) {
-    // Add each cell in y to x
-    while (y->count) {
-        x = lval_add(x, lval_pop(y,0));
+    // If y is the longer list and x and y are both ours, prepend x's cells
+    // to y instead. That keeps recursive list building such as stdlib's map
+    // (join (list a) rest) linear.
+    if (y->ref == 1 && !y->owner && x->ref == 1 && !x->owner &&
+            x->count < y->count) {
+        lval_reserve_front(y, x->count);
+        y->cell -= x->count;
+        y->offset -= x->count;
+        y->count += x->count;
+        memcpy(y->cell, x->cell, sizeof(lval*) * x->count);
+        y->type = x->type;
+        x->count = 0;
+        lval_del(x);
+        return y;
+    }
+
+    // Add each cell in y to x. y may be shared, so its cells are referenced
+    // rather than popped.
+    for (int i = 0; i < y->count; i++) {
+        x = lval_add(x, lval_ref(y->cell[i]));
     }
     
     lval_del(y);
@@ -458,21 +1626,600 @@ lval* builtin_init(lenv* e, lval* a) {
 		CHECK_INPUT_TYPE("init", a, 0, LVAL_QEXPR);
 		CHECK_EMPTY(a, "Function 'init' passed {}!");
     
-    lval* x = lval_take(a,0);
+    lval* x = lval_own(lval_take(a,0));
     lval_del(lval_pop(x, x->count-1));
     return x;
 }
 
+// Native versions of stdlib's list functions. They give the same results
+// as the Lisp definitions (kept in lists.lispr) but loop in C instead of
+// recursing over head and tail. Like stdlib's fst, they evaluate list items
+// before use.
+lval* lval_fst(lenv* e, lval* x) {
+	return lval_eval(e, lval_add(lval_sexpr(), lval_ref(x)));
+}
+
+// Check that argument i of a is an index from 0 to max. Returns an error
+// if it isn't, or NULL.
+lval* lval_index_check(lval* a, int i, int max, char* fun) {
+	lval* n = a->cell[i];
+	if (n->type != LVAL_NUM || n->num.type != LONG) {
+		return lval_err("Function '%s' passed wrong argument type. Expected "
+				"argument %d to be an integer.", fun, i);
+	}
+	if (n->num.l < 0 || n->num.l > max) {
+		return lval_err("Function '%s' passed index %li, expected 0 to %d.", fun,
+				n->num.l, max);
+	}
+	return NULL;
+}
+
+lval* builtin_map(lenv* e, lval* a) {
+	CHECK_COUNT("map", a, 2);
+	CHECK_INPUT_TYPE("map", a, 0, LVAL_FUN);
+	CHECK_INPUT_TYPE("map", a, 1, LVAL_QEXPR);
+
+	lval* f = a->cell[0];
+	lval* l = a->cell[1];
+	lval* x = lval_qexpr();
+	lval_reserve(x, l->count);
+	for (int i = 0; i < l->count; i++) {
+		lval* y = lval_fst(e, l->cell[i]);
+		if (y->type != LVAL_ERR) y = lval_call(e, f, lval_add(lval_sexpr(), y));
+		if (y->type == LVAL_ERR) {
+			lval_del(x); lval_del(a);
+			return y;
+		}
+		lval_add(x, y);
+	}
+	lval_del(a);
+	return x;
+}
+
+lval* builtin_filter(lenv* e, lval* a) {
+	CHECK_COUNT("filter", a, 2);
+	CHECK_INPUT_TYPE("filter", a, 0, LVAL_FUN);
+	CHECK_INPUT_TYPE("filter", a, 1, LVAL_QEXPR);
+
+	lval* f = a->cell[0];
+	lval* l = a->cell[1];
+	lval* x = lval_qexpr();
+	for (int i = 0; i < l->count; i++) {
+		lval* y = lval_fst(e, l->cell[i]);
+		if (y->type != LVAL_ERR) y = lval_call(e, f, lval_add(lval_sexpr(), y));
+		if (y->type != LVAL_ERR && y->type != LVAL_BOOL) {
+			lval* err = lval_err("Function 'filter' expects a predicate. Got %s, "
+					"expected %s.", ltype_name(y->type), ltype_name(LVAL_BOOL));
+			lval_del(y);
+			y = err;
+		}
+		if (y->type == LVAL_ERR) {
+			lval_del(x); lval_del(a);
+			return y;
+		}
+		// Items are kept as they were, not evaluated
+		if (y->bool == TRUE) lval_add(x, lval_ref(l->cell[i]));
+		lval_del(y);
+	}
+	lval_del(a);
+	return x;
+}
+
+lval* builtin_foldl(lenv* e, lval* a) {
+	CHECK_COUNT("foldl", a, 3);
+	CHECK_INPUT_TYPE("foldl", a, 0, LVAL_FUN);
+	CHECK_INPUT_TYPE("foldl", a, 2, LVAL_QEXPR);
+
+	lval* f = a->cell[0];
+	lval* l = a->cell[2];
+	lval* z = lval_ref(a->cell[1]);
+	for (int i = 0; i < l->count; i++) {
+		lval* y = lval_fst(e, l->cell[i]);
+		if (y->type == LVAL_ERR) {
+			lval_del(z);
+			z = y;
+			break;
+		}
+		z = lval_call(e, f, lval_add(lval_add(lval_sexpr(), z), y));
+		if (z->type == LVAL_ERR) break;
+	}
+	lval_del(a);
+	return z;
+}
+
+lval* builtin_nth(lenv* e, lval* a) {
+	CHECK_COUNT("nth", a, 2);
+	CHECK_INPUT_TYPE("nth", a, 1, LVAL_QEXPR);
+	lval* err = lval_index_check(a, 0, a->cell[1]->count - 1, "nth");
+	if (err) {
+		lval_del(a);
+		return err;
+	}
+
+	lval* x = lval_fst(e, a->cell[1]->cell[a->cell[0]->num.l]);
+	lval_del(a);
+	return x;
+}
+
+lval* builtin_last(lenv* e, lval* a) {
+	CHECK_COUNT("last", a, 1);
+	CHECK_INPUT_TYPE("last", a, 0, LVAL_QEXPR);
+	CHECK_EMPTY(a, "Function 'last' passed {}!");
+
+	lval* x = lval_fst(e, a->cell[0]->cell[a->cell[0]->count-1]);
+	lval_del(a);
+	return x;
+}
+
+lval* builtin_elem(lenv* e, lval* a) {
+	CHECK_COUNT("elem", a, 2);
+	CHECK_INPUT_TYPE("elem", a, 1, LVAL_QEXPR);
+
+	// Answers with stdlib's true and false
+	Num n;
+	n.type = LONG;
+	n.l = FALSE;
+	lval* l = a->cell[1];
+	for (int i = 0; i < l->count && n.l == FALSE; i++) {
+		lval* y = lval_fst(e, l->cell[i]);
+		if (y->type == LVAL_ERR) {
+			lval_del(a);
+			return y;
+		}
+		n.l = lval_eq(a->cell[0], y);
+		lval_del(y);
+	}
+	lval_del(a);
+	return lval_num(n);
+}
+
+// The first n items of l, which is consumed
+lval* lval_take_n(lval* l, int n) {
+	lval* x = lval_qexpr();
+	lval_reserve(x, n);
+	for (int i = 0; i < n; i++) lval_add(x, lval_ref(l->cell[i]));
+	lval_del(l);
+	return x;
+}
+
+// l without its first n items. As with tail, a shared list isn't copied.
+lval* lval_drop_n(lval* l, int n) {
+	if (l->ref > 1 || l->owner) {
+		lval* x = lval_slice(l, n, l->count - n);
+		lval_del(l);
+		return x;
+	}
+	while (n--) lval_del(lval_pop(l, 0));
+	return l;
+}
+
+lval* builtin_take(lenv* e, lval* a) {
+	CHECK_COUNT("take", a, 2);
+	CHECK_INPUT_TYPE("take", a, 1, LVAL_QEXPR);
+	lval* err = lval_index_check(a, 0, a->cell[1]->count, "take");
+	if (err) {
+		lval_del(a);
+		return err;
+	}
+
+	int n = a->cell[0]->num.l;
+	return lval_take_n(lval_take(a, 1), n);
+}
+
+lval* builtin_drop(lenv* e, lval* a) {
+	CHECK_COUNT("drop", a, 2);
+	CHECK_INPUT_TYPE("drop", a, 1, LVAL_QEXPR);
+	lval* err = lval_index_check(a, 0, a->cell[1]->count, "drop");
+	if (err) {
+		lval_del(a);
+		return err;
+	}
+
+	int n = a->cell[0]->num.l;
+	return lval_drop_n(lval_take(a, 1), n);
+}
+
+lval* builtin_split(lenv* e, lval* a) {
+	CHECK_COUNT("split", a, 2);
+	CHECK_INPUT_TYPE("split", a, 1, LVAL_QEXPR);
+	lval* err = lval_index_check(a, 0, a->cell[1]->count, "split");
+	if (err) {
+		lval_del(a);
+		return err;
+	}
+
+	int n = a->cell[0]->num.l;
+	lval* l = lval_take(a, 1);
+	lval* x = lval_qexpr();
+	lval_add(x, lval_take_n(lval_ref(l), n));
+	lval_add(x, lval_drop_n(l, n));
+	return x;
+}
+
+// Numeric vectors. Their elements are unboxed and all of one type, so the
+// kernels below run over plain arrays. Double kernels use AVX or SSE2 when
+// the compiler targets them, with a scalar loop for the remainder (and for
+// everything on other targets). Long kernels stay scalar: their elements
+// are checked for overflow, as the number builtins do.
+lval* lval_vec(int vtype, int len) {
+	lval* v = lval_alloc();
+	v->type = LVAL_VEC;
+	v->ref = 1;
+	v->vtype = vtype;
+	v->len = len;
+	v->vd = NULL;
+	v->vd = malloc((vtype == LONG ? sizeof(long) : sizeof(double)) *
+			(len ? len : 1));
+	return v;
+}
+
+#if defined(__AVX__)
+#define VEC_WIDTH 4
+#define VEC_D __m256d
+#define VEC_LOAD _mm256_loadu_pd
+#define VEC_STORE _mm256_storeu_pd
+#define VEC_SET1 _mm256_set1_pd
+#define VEC_ADD _mm256_add_pd
+#define VEC_SUB _mm256_sub_pd
+#define VEC_MUL _mm256_mul_pd
+#define VEC_DIV _mm256_div_pd
+#define VEC_MIN _mm256_min_pd
+#define VEC_MAX _mm256_max_pd
+#elif defined(__SSE2__)
+#define VEC_WIDTH 2
+#define VEC_D __m128d
+#define VEC_LOAD _mm_loadu_pd
+#define VEC_STORE _mm_storeu_pd
+#define VEC_SET1 _mm_set1_pd
+#define VEC_ADD _mm_add_pd
+#define VEC_SUB _mm_sub_pd
+#define VEC_MUL _mm_mul_pd
+#define VEC_DIV _mm_div_pd
+#define VEC_MIN _mm_min_pd
+#define VEC_MAX _mm_max_pd
+#endif
+
+// out = x op y, elementwise
+void vec_kernel_op(char op, double* out, double* x, double* y, int n) {
+	int i = 0;
+#ifdef VEC_WIDTH
+	for (; i + VEC_WIDTH <= n; i += VEC_WIDTH) {
+		VEC_D a = VEC_LOAD(x + i), b = VEC_LOAD(y + i);
+		switch (op) {
+			case '+': VEC_STORE(out + i, VEC_ADD(a, b)); break;
+			case '-': VEC_STORE(out + i, VEC_SUB(a, b)); break;
+			case '*': VEC_STORE(out + i, VEC_MUL(a, b)); break;
+			case '/': VEC_STORE(out + i, VEC_DIV(a, b)); break;
+		}
+	}
+#endif
+	for (; i < n; i++) {
+		switch (op) {
+			case '+': out[i] = x[i] + y[i]; break;
+			case '-': out[i] = x[i] - y[i]; break;
+			case '*': out[i] = x[i] * y[i]; break;
+			case '/': out[i] = x[i] / y[i]; break;
+		}
+	}
+}
+
+void vec_kernel_scale(double* out, double* x, double k, int n) {
+	int i = 0;
+#ifdef VEC_WIDTH
+	VEC_D kk = VEC_SET1(k);
+	for (; i + VEC_WIDTH <= n; i += VEC_WIDTH) {
+		VEC_STORE(out + i, VEC_MUL(VEC_LOAD(x + i), kk));
+	}
+#endif
+	for (; i < n; i++) out[i] = x[i] * k;
+}
+
+// Sum of x[i] * y[i], or of x[i] if y is NULL. The vector loop keeps
+// VEC_WIDTH partial sums, so rounding may differ from a scalar loop.
+double vec_kernel_dot(double* x, double* y, int n) {
+	int i = 0;
+	double sum = 0;
+#ifdef VEC_WIDTH
+	double lanes[VEC_WIDTH];
+	VEC_D acc = VEC_SET1(0);
+	for (; i + VEC_WIDTH <= n; i += VEC_WIDTH) {
+		VEC_D a = VEC_LOAD(x + i);
+		acc = VEC_ADD(acc, y ? VEC_MUL(a, VEC_LOAD(y + i)) : a);
+	}
+	VEC_STORE(lanes, acc);
+	for (int j = 0; j < VEC_WIDTH; j++) sum += lanes[j];
+#endif
+	for (; i < n; i++) sum += y ? x[i] * y[i] : x[i];
+	return sum;
+}
+
+// Smallest (or largest, if max) of n >= 1 elements
+double vec_kernel_minmax(double* x, int n, int max) {
+	int i = 0;
+	double m = x[0];
+#ifdef VEC_WIDTH
+	if (n >= VEC_WIDTH) {
+		double lanes[VEC_WIDTH];
+		VEC_D acc = VEC_LOAD(x);
+		for (i = VEC_WIDTH; i + VEC_WIDTH <= n; i += VEC_WIDTH) {
+			VEC_D a = VEC_LOAD(x + i);
+			acc = max ? VEC_MAX(acc, a) : VEC_MIN(acc, a);
+		}
+		VEC_STORE(lanes, acc);
+		for (int j = 0; j < VEC_WIDTH; j++) {
+			if (max ? lanes[j] > m : lanes[j] < m) m = lanes[j];
+		}
+	}
+#endif
+	for (; i < n; i++) {
+		if (max ? x[i] > m : x[i] < m) m = x[i];
+	}
+	return m;
+}
+
+// Sum of x[i] * y[i], or of x[i] if y is NULL, carrying on in a bignum if
+// a long overflows
+Num vec_long_dot(long* x, long* y, int n) {
+	Num sum;
+	sum.type = LONG;
+	sum.l = 0;
+	int i = 0;
+	for (; i < n; i++) {
+		long p = x[i];
+		if (y && __builtin_mul_overflow(x[i], y[i], &p)) break;
+		if (__builtin_add_overflow(sum.l, p, &p)) break;
+		sum.l = p;
+	}
+	for (; i < n; i++) {
+		Num p;
+		p.type = LONG;
+		p.l = x[i];
+		if (y) {
+			Num q;
+			q.type = LONG;
+			q.l = y[i];
+			num_arith('*', &p, q);
+		}
+		num_arith('+', &sum, p);
+		num_clear(&p);
+	}
+	return sum;
+}
+
+// Elements of v as doubles. Returns v's own array if it holds doubles,
+// otherwise a converted copy for the caller to free.
+double* vec_doubles(lval* v) {
+	if (v->vtype == DOUBLE) return v->vd;
+	double* d = malloc(sizeof(double) * (v->len ? v->len : 1));
+	for (int i = 0; i < v->len; i++) d[i] = v->vl[i];
+	return d;
+}
+
+lval* builtin_vec(lenv* e, lval* a) {
+	CHECK_COUNT("vec", a, 1);
+	CHECK_INPUT_TYPE("vec", a, 0, LVAL_QEXPR);
+
+	// The vector holds longs unless there is a double among the items
+	lval* l = a->cell[0];
+	int vtype = LONG;
+	for (int i = 0; i < l->count; i++) {
+		LASSERT(a, l->cell[i]->type == LVAL_NUM && l->cell[i]->num.type != BIG,
+				"Function 'vec' needs a list of numbers that fit in a long or double. "
+				"Got %s at position %d.", ltype_name(l->cell[i]->type), i);
+		if (l->cell[i]->num.type == DOUBLE) vtype = DOUBLE;
+	}
+
+	lval* v = lval_vec(vtype, l->count);
+	for (int i = 0; i < l->count; i++) {
+		if (vtype == LONG) v->vl[i] = l->cell[i]->num.l;
+		else v->vd[i] = num_to_double(l->cell[i]->num);
+	}
+	lval_del(a);
+	return v;
+}
+
+lval* builtin_vec_list(lenv* e, lval* a) {
+	CHECK_COUNT("vec-list", a, 1);
+	CHECK_INPUT_TYPE("vec-list", a, 0, LVAL_VEC);
+
+	lval* v = a->cell[0];
+	lval* l = lval_qexpr();
+	lval_reserve(l, v->len);
+	for (int i = 0; i < v->len; i++) {
+		Num n;
+		n.type = v->vtype;
+		if (n.type == LONG) n.l = v->vl[i];
+		else n.d = v->vd[i];
+		lval_add(l, lval_num(n));
+	}
+	lval_del(a);
+	return l;
+}
+
+lval* builtin_vec_add(lenv* e, lval* a) {
+	return builtin_vec_op(e, a, '+');
+}
+
+lval* builtin_vec_sub(lenv* e, lval* a) {
+	return builtin_vec_op(e, a, '-');
+}
+
+lval* builtin_vec_mul(lenv* e, lval* a) {
+	return builtin_vec_op(e, a, '*');
+}
+
+lval* builtin_vec_div(lenv* e, lval* a) {
+	return builtin_vec_op(e, a, '/');
+}
+
+// Elementwise op on two vectors of the same length. Long vectors give a
+// long vector, with / dividing as it does for longs; anything else gives
+// doubles.
+lval* builtin_vec_op(lenv* e, lval* a, char op) {
+	char name[] = {'v', 'e', 'c', op, '\0'};
+	CHECK_COUNT(name, a, 2);
+	CHECK_INPUT_TYPE(name, a, 0, LVAL_VEC);
+	CHECK_INPUT_TYPE(name, a, 1, LVAL_VEC);
+	lval* x = a->cell[0];
+	lval* y = a->cell[1];
+	LASSERT(a, x->len == y->len, "Function '%s' passed vectors of lengths %d "
+			"and %d.", name, x->len, y->len);
+
+	lval* v;
+	if (x->vtype == LONG && y->vtype == LONG) {
+		v = lval_vec(LONG, x->len);
+		for (int i = 0; i < x->len; i++) {
+			long r = 0;
+			int failed = 0;
+			switch (op) {
+				case '+': failed = __builtin_add_overflow(x->vl[i], y->vl[i], &r); break;
+				case '-': failed = __builtin_sub_overflow(x->vl[i], y->vl[i], &r); break;
+				case '*': failed = __builtin_mul_overflow(x->vl[i], y->vl[i], &r); break;
+				case '/':
+					if (y->vl[i] == 0) {
+						lval_del(v); lval_del(a);
+						return lval_err("division by zero");
+					}
+					failed = x->vl[i] == LONG_MIN && y->vl[i] == -1;
+					if (!failed) r = x->vl[i] / y->vl[i];
+				break;
+			}
+			if (failed) {
+				lval_del(v); lval_del(a);
+				return lval_err("Function '%s' overflowed a long at position %d.",
+						name, i);
+			}
+			v->vl[i] = r;
+		}
+	}
+	else {
+		v = lval_vec(DOUBLE, x->len);
+		double* xd = vec_doubles(x);
+		double* yd = vec_doubles(y);
+		vec_kernel_op(op, v->vd, xd, yd, x->len);
+		if (xd != x->vd) free(xd);
+		if (yd != y->vd) free(yd);
+	}
+	lval_del(a);
+	return v;
+}
+
+lval* builtin_vec_scale(lenv* e, lval* a) {
+	CHECK_COUNT("vec-scale", a, 2);
+	CHECK_INPUT_TYPE("vec-scale", a, 0, LVAL_VEC);
+	CHECK_INPUT_TYPE("vec-scale", a, 1, LVAL_NUM);
+	lval* x = a->cell[0];
+	Num k = a->cell[1]->num;
+	LASSERT(a, k.type != BIG, "Function 'vec-scale' passed a factor that "
+			"doesn't fit in a long.");
+
+	lval* v;
+	if (x->vtype == LONG && k.type == LONG) {
+		v = lval_vec(LONG, x->len);
+		for (int i = 0; i < x->len; i++) {
+			if (__builtin_mul_overflow(x->vl[i], k.l, &v->vl[i])) {
+				lval_del(v); lval_del(a);
+				return lval_err("Function 'vec-scale' overflowed a long at position "
+						"%d.", i);
+			}
+		}
+	}
+	else {
+		v = lval_vec(DOUBLE, x->len);
+		double* xd = vec_doubles(x);
+		vec_kernel_scale(v->vd, xd, num_to_double(k), x->len);
+		if (xd != x->vd) free(xd);
+	}
+	lval_del(a);
+	return v;
+}
+
+lval* builtin_dot(lenv* e, lval* a) {
+	CHECK_COUNT("dot", a, 2);
+	CHECK_INPUT_TYPE("dot", a, 0, LVAL_VEC);
+	CHECK_INPUT_TYPE("dot", a, 1, LVAL_VEC);
+	lval* x = a->cell[0];
+	lval* y = a->cell[1];
+	LASSERT(a, x->len == y->len, "Function 'dot' passed vectors of lengths %d "
+			"and %d.", x->len, y->len);
+
+	Num n;
+	if (x->vtype == LONG && y->vtype == LONG) {
+		n = vec_long_dot(x->vl, y->vl, x->len);
+	}
+	else {
+		double* xd = vec_doubles(x);
+		double* yd = vec_doubles(y);
+		n.type = DOUBLE;
+		n.d = vec_kernel_dot(xd, yd, x->len);
+		if (xd != x->vd) free(xd);
+		if (yd != y->vd) free(yd);
+	}
+	lval_del(a);
+	return lval_num(n);
+}
+
+lval* builtin_vec_sum(lenv* e, lval* a) {
+	CHECK_COUNT("vec-sum", a, 1);
+	CHECK_INPUT_TYPE("vec-sum", a, 0, LVAL_VEC);
+	lval* x = a->cell[0];
+
+	Num n;
+	if (x->vtype == LONG) {
+		n = vec_long_dot(x->vl, NULL, x->len);
+	}
+	else {
+		n.type = DOUBLE;
+		n.d = vec_kernel_dot(x->vd, NULL, x->len);
+	}
+	lval_del(a);
+	return lval_num(n);
+}
+
+lval* builtin_vec_min(lenv* e, lval* a) {
+	return builtin_vec_minmax(e, a, 0);
+}
+
+lval* builtin_vec_max(lenv* e, lval* a) {
+	return builtin_vec_minmax(e, a, 1);
+}
+
+lval* builtin_vec_minmax(lenv* e, lval* a, int max) {
+	char* name = max ? "vec-max" : "vec-min";
+	CHECK_COUNT(name, a, 1);
+	CHECK_INPUT_TYPE(name, a, 0, LVAL_VEC);
+	lval* x = a->cell[0];
+	LASSERT(a, x->len > 0, "Function '%s' passed an empty vector.", name);
+
+	Num n;
+	n.type = x->vtype;
+	if (x->vtype == LONG) {
+		n.l = x->vl[0];
+		for (int i = 1; i < x->len; i++) {
+			if (max ? x->vl[i] > n.l : x->vl[i] < n.l) n.l = x->vl[i];
+		}
+	}
+	else {
+		n.d = vec_kernel_minmax(x->vd, x->len, max);
+	}
+	lval_del(a);
+	return lval_num(n);
+}
+
 lval* lval_fun(lbuiltin func) {
-    lval* v = malloc(sizeof(lval));
+    lval* v = lval_alloc();
     v->builtin = func;
     v->type = LVAL_FUN;
+    v->ref = 1;
     return v;
 }
 
 lval* lval_copy(lval* v) {
-    lval* x = malloc(sizeof(lval));
+    // Shallow copy: the new value gets its own top-level storage, but any
+    // values it contains are shared with v
+    lval* x = lval_alloc();
     x->type = v->type;
+    x->ref = 1;
     
     switch (v->type) {
         case LVAL_FUN: 
@@ -480,22 +2227,25 @@ lval* lval_copy(lval* v) {
 						x->builtin = v->builtin;
 					}
 					else {
+						// Fill in x before lenv_copy allocates, so a collection
+						// never sees it half built
 						x->builtin = NULL;
-						x->env = lenv_copy(v->env);
-						x->formals = lval_copy(v->formals);
-						x->body = lval_copy(v->body);
+						x->env = NULL;
+						x->formals = lval_ref(v->formals);
+						x->body = lval_ref(v->body);
+						x->code = v->code;
+						if (x->code) x->code->ref++;
+						x->bound = v->bound;
+						if (v->env) x->env = lenv_copy(v->env);
 					}
 				break;
-        case LVAL_NUM: x->num = v->num; break;
+        case LVAL_NUM: x->num = num_copy(v->num); break;
             
         case LVAL_ERR:
             x->err = malloc(strlen(v->err)+1);
             strcpy(x->err, v->err); 
 				break;
-        case LVAL_SYM:
-            x->sym = malloc(strlen(v->sym)+1);
-            strcpy(x->sym, v->sym); 
-				break;
+        case LVAL_SYM: x->sym = v->sym; break;
 				case LVAL_STR:
 						x->str = malloc(strlen(v->str)+1);
 						strcpy(x->str, v->str);
@@ -504,42 +2254,97 @@ lval* lval_copy(lval* v) {
         case LVAL_SEXPR:
         case LVAL_QEXPR:
             x->count = v->count;
+            x->size = v->count;
+            x->offset = 0;
+            x->owner = NULL;
             x->cell = malloc(sizeof(lval*) * x->count);
             for (int i = 0; i < x->count; i++) {
-                x->cell[i] = lval_copy(v->cell[i]);
+                x->cell[i] = lval_ref(v->cell[i]);
             }
 				break;
 				case LVAL_BOOL:
 					x->bool = v->bool;
+				break;
+				case LVAL_VEC: {
+					size_t n = (v->vtype == LONG ? sizeof(long) : sizeof(double)) *
+						(v->len ? v->len : 1);
+					x->len = v->len;
+					x->vtype = v->vtype;
+					x->vd = malloc(n);
+					memcpy(x->vd, v->vd, n);
+				}
+				break;
     }
     return x;
 }
 
 lenv* lenv_new(void) {
-    lenv* e = malloc(sizeof(lenv));
+    lenv* e = lenv_alloc();
 		e->par = NULL;
     e->count = 0;
     e->syms = NULL;
     e->vals = NULL;
+		e->size = 0;
+		e->index = NULL;
     return e;
 }
 
 void lenv_del(lenv* e) {
+#ifdef LISPR_GC
+    // Frames can still be reached through their callees' parents; only the
+    // collector knows when they are unreachable
+    return;
+#endif
     for (int i = 0; i < e->count; i++) {
-        free(e->syms[i]);
         lval_del(e->vals[i]);
     }
     free(e->syms);
     free(e->vals);
-    free(e);
+		free(e->index);
+    lenv_free(e);
+}
+
+// Symbols are interned, so the hash is taken from the name's address
+unsigned lenv_hash(char* s) {
+	uintptr_t p = (uintptr_t) s;
+	return (unsigned) ((p >> 4) ^ (p >> 16)) * 2654435761u;
+}
+
+// Position of interned symbol s in e->syms, or -1 if it isn't bound in e
+int lenv_find(lenv* e, char* s) {
+	if (e->index) {
+		unsigned mask = e->size - 1;
+		for (unsigned h = lenv_hash(s) & mask; e->index[h]; h = (h+1) & mask) {
+			int i = e->index[h] - 1;
+			if (e->syms[i] == s) return i;
+		}
+		return -1;
+	}
+
+	for (int i = 0; i < e->count; i++) {
+		if (e->syms[i] == s) return i;
+	}
+	return -1;
+}
+
+// Rebuild the hash index so it can hold at least twice e->count entries
+void lenv_reindex(lenv* e) {
+	int size = LENV_INDEX_MIN * 2;
+	while (size < e->count * 2) size *= 2;
+
+	free(e->index);
+	e->size = size;
+	e->index = calloc(size, sizeof(int));
+	for (int i = 0; i < e->count; i++) {
+		unsigned h = lenv_hash(e->syms[i]) & (size-1);
+		while (e->index[h]) h = (h+1) & (size-1);
+		e->index[h] = i+1;
+	}
 }
 
 lval* lenv_get(lenv* e, lval* v) {
-    for (int i = 0; i < e->count; i++) {
-        if (strcmp(e->syms[i], v->sym) == 0) {
-            return lval_copy(e->vals[i]);
-        }
-    }
+		int i = lenv_find(e, v->sym);
+		if (i >= 0) return lval_ref(e->vals[i]);
 
 		if (e->par) {
 			return lenv_get(e->par, v);
@@ -547,24 +2352,527 @@ lval* lenv_get(lenv* e, lval* v) {
 		return lval_err("Unbound symbol '%s'", v->sym);
 }
 
+// Symbols that have ever been bound outside the global environment: every
+// lambda's formals, and anything assigned with = inside a function. A
+// symbol not in this set can only be bound globally, so wherever it is
+// looked up from, it resolves to the same slot of the global environment.
+// Adding to the set is the one thing that can change where a cached lookup
+// should resolve to, so it bumps lenv_version. Slots never move, and a
+// global being redefined changes only the value in its slot.
+static char** shadowed = NULL;
+static int shadowed_count = 0;
+static int shadowed_size = 0;
+
+unsigned long lenv_version = 1;
+long lenv_cache_hits = 0;
+long lenv_cache_misses = 0;
+
+int lenv_shadowed(char* s) {
+	if (!shadowed) return FALSE;
+	unsigned mask = shadowed_size - 1;
+	for (unsigned h = lenv_hash(s) & mask; shadowed[h]; h = (h+1) & mask) {
+		if (shadowed[h] == s) return TRUE;
+	}
+	return FALSE;
+}
+
+void lenv_shadow(char* s) {
+	if (lenv_shadowed(s)) return;
+	lenv_version++;
+
+	// Keep the set at most half full
+	if ((shadowed_count+1) * 2 > shadowed_size) {
+		char** old = shadowed;
+		int old_size = shadowed_size;
+		shadowed_size = shadowed_size ? shadowed_size * 2 : 64;
+		shadowed = calloc(shadowed_size, sizeof(char*));
+		for (int i = 0; i < old_size; i++) {
+			if (!old[i]) continue;
+			unsigned h = lenv_hash(old[i]) & (shadowed_size-1);
+			while (shadowed[h]) h = (h+1) & (shadowed_size-1);
+			shadowed[h] = old[i];
+		}
+		free(old);
+	}
+	unsigned h = lenv_hash(s) & (shadowed_size-1);
+	while (shadowed[h]) h = (h+1) & (shadowed_size-1);
+	shadowed[h] = s;
+	shadowed_count++;
+}
+
+// lenv_get for a reference in compiled code, which remembers in c where a
+// global was found. vm_lookup checks c itself before calling this, so
+// getting here is a miss.
+lval* lenv_get_cached(lenv* e, lval* k, lcache* c) {
+	lenv_cache_misses++;
+	if (lenv_shadowed(k->sym)) return lenv_get(e, k);
+
+	while (e->par) e = e->par;
+	int i = lenv_find(e, k->sym);
+	if (i < 0) return lval_err("Unbound symbol '%s'", k->sym);
+	c->version = lenv_version;
+	c->env = e;
+	c->index = i;
+	return lval_ref(e->vals[i]);
+}
+
 void lenv_put(lenv* e, lval* k, lval* v) {
     // Check if symbol already exists
-    for (int i = 0; i < e->count; i++) {
-        if (strcmp(e->syms[i], k->sym) == 0) {
-            lval_del(e->vals[i]);
-            e->vals[i] = lval_copy(v);
-            return;
-        }
-    }
-    
-    // Create space and add symbol
+		int i = lenv_find(e, k->sym);
+		if (i >= 0) {
+			lval_del(e->vals[i]);
+			e->vals[i] = lval_ref(v);
+			return;
+		}
+		lenv_push(e, k, v);
+}
+
+// Add a binding for a symbol known not to be bound in e yet
+void lenv_push(lenv* e, lval* k, lval* v) {
+    // Create space and add symbol. Storage grows in powers of two so that
+		// repeated definitions don't realloc every time.
+		if ((e->count & (e->count-1)) == 0) {
+			int cap = e->count ? e->count * 2 : 1;
+			e->vals = realloc(e->vals, cap * sizeof(lval*));
+			e->syms = realloc(e->syms, cap * sizeof(char*));
+		}
     e->count++;
-    e->vals = realloc(e->vals, e->count * sizeof(lval*));
-    e->syms = realloc(e->syms, e->count * sizeof(char*));
     
-    e->vals[e->count-1] = lval_copy(v);
-    e->syms[e->count-1] = malloc(strlen(k->sym)+1);
-    strcpy(e->syms[e->count-1], k->sym);
+    e->vals[e->count-1] = lval_ref(v);
+    e->syms[e->count-1] = k->sym;
+
+		// Keep the index at most half full
+		if (e->count > LENV_INDEX_MIN && e->count * 2 > e->size) {
+			lenv_reindex(e);
+		}
+		else if (e->index) {
+			unsigned h = lenv_hash(k->sym) & (e->size-1);
+			while (e->index[h]) h = (h+1) & (e->size-1);
+			e->index[h] = e->count;
+		}
+}
+
+// Bignums. Limbs are 32 bits so that products and carries fit in an
+// unsigned long long.
+lbig* big_new(int count) {
+	lbig* b = malloc(sizeof(lbig));
+	b->sign = 1;
+	b->count = count;
+	b->d = calloc(count ? count : 1, sizeof(unsigned));
+	return b;
+}
+
+void big_del(lbig* b) {
+	free(b->d);
+	free(b);
+}
+
+lbig* big_copy(lbig* b) {
+	lbig* x = big_new(b->count);
+	x->sign = b->sign;
+	memcpy(x->d, b->d, sizeof(unsigned) * b->count);
+	return x;
+}
+
+lbig* big_from_long(long l) {
+	unsigned long long m = l < 0 ? -(unsigned long long) l : (unsigned long long) l;
+	lbig* b = big_new(2);
+	b->sign = l < 0 ? -1 : 1;
+	b->d[0] = (unsigned) m;
+	b->d[1] = (unsigned) (m >> 32);
+	big_trim(b);
+	return b;
+}
+
+// Drop leading zero limbs
+void big_trim(lbig* b) {
+	while (b->count && b->d[b->count-1] == 0) b->count--;
+	if (b->count == 0) b->sign = 1;
+}
+
+double big_to_double(lbig* b) {
+	double d = 0;
+	for (int i = b->count-1; i >= 0; i--) d = d * 4294967296.0 + b->d[i];
+	return b->sign * d;
+}
+
+// Compare magnitudes
+int big_cmp_mag(lbig* a, lbig* b) {
+	if (a->count != b->count) return a->count < b->count ? -1 : 1;
+	for (int i = a->count-1; i >= 0; i--) {
+		if (a->d[i] != b->d[i]) return a->d[i] < b->d[i] ? -1 : 1;
+	}
+	return 0;
+}
+
+int big_cmp(lbig* a, lbig* b) {
+	if (a->sign != b->sign) return a->sign;
+	return a->sign * big_cmp_mag(a, b);
+}
+
+lbig* big_add_mag(lbig* a, lbig* b) {
+	if (a->count < b->count) { lbig* t = a; a = b; b = t; }
+	lbig* r = big_new(a->count + 1);
+	unsigned long long c = 0;
+	for (int i = 0; i < a->count; i++) {
+		c += (unsigned long long) a->d[i] + (i < b->count ? b->d[i] : 0);
+		r->d[i] = (unsigned) c;
+		c >>= 32;
+	}
+	r->d[a->count] = (unsigned) c;
+	big_trim(r);
+	return r;
+}
+
+// |a| - |b|, where |a| >= |b|
+lbig* big_sub_mag(lbig* a, lbig* b) {
+	lbig* r = big_new(a->count);
+	long long c = 0;
+	for (int i = 0; i < a->count; i++) {
+		c += (long long) a->d[i] - (i < b->count ? b->d[i] : 0);
+		r->d[i] = (unsigned) c;
+		c = c < 0 ? -1 : 0;
+	}
+	big_trim(r);
+	return r;
+}
+
+lbig* big_add(lbig* a, lbig* b) {
+	lbig* r;
+	if (a->sign == b->sign) {
+		r = big_add_mag(a, b);
+		r->sign = a->sign;
+	}
+	else if (big_cmp_mag(a, b) >= 0) {
+		r = big_sub_mag(a, b);
+		r->sign = a->sign;
+	}
+	else {
+		r = big_sub_mag(b, a);
+		r->sign = b->sign;
+	}
+	big_trim(r);
+	return r;
+}
+
+lbig* big_sub(lbig* a, lbig* b) {
+	lbig nb = *b;
+	nb.sign = -b->sign;
+	return big_add(a, &nb);
+}
+
+lbig* big_mul(lbig* a, lbig* b) {
+	lbig* r = big_new(a->count + b->count);
+	for (int i = 0; i < a->count; i++) {
+		unsigned long long c = 0;
+		for (int j = 0; j < b->count; j++) {
+			c += (unsigned long long) a->d[i] * b->d[j] + r->d[i+j];
+			r->d[i+j] = (unsigned) c;
+			c >>= 32;
+		}
+		r->d[i + b->count] = (unsigned) c;
+	}
+	r->sign = a->sign * b->sign;
+	big_trim(r);
+	return r;
+}
+
+// Divide the magnitude of a in place by a single limb, returning the
+// remainder
+unsigned big_divmod_small(lbig* a, unsigned v) {
+	unsigned long long rem = 0;
+	for (int i = a->count-1; i >= 0; i--) {
+		rem = (rem << 32) | a->d[i];
+		a->d[i] = (unsigned) (rem / v);
+		rem %= v;
+	}
+	big_trim(a);
+	return (unsigned) rem;
+}
+
+// Long division of magnitudes u (m limbs) by v (n limbs, n >= 2, m >= n),
+// Knuth's algorithm D. q gets m-n+1 limbs and r n limbs.
+void big_divmod_mag(unsigned* q, unsigned* r, unsigned* u, unsigned* v,
+		int m, int n) {
+	// Normalise so the divisor's top limb has its high bit set
+	int s = __builtin_clz(v[n-1]);
+	unsigned* vn = malloc(sizeof(unsigned) * n);
+	unsigned* un = malloc(sizeof(unsigned) * (m+1));
+	for (int i = n-1; i > 0; i--) {
+		vn[i] = (v[i] << s) | (s ? v[i-1] >> (32-s) : 0);
+	}
+	vn[0] = v[0] << s;
+	un[m] = s ? u[m-1] >> (32-s) : 0;
+	for (int i = m-1; i > 0; i--) {
+		un[i] = (u[i] << s) | (s ? u[i-1] >> (32-s) : 0);
+	}
+	un[0] = u[0] << s;
+
+	for (int j = m-n; j >= 0; j--) {
+		// Estimate the quotient limb from the top two limbs, then correct it
+		unsigned long long num = ((unsigned long long) un[j+n] << 32) | un[j+n-1];
+		unsigned long long qhat = num / vn[n-1];
+		unsigned long long rhat = num % vn[n-1];
+		while (qhat >> 32 || qhat * vn[n-2] > ((rhat << 32) | un[j+n-2])) {
+			qhat--;
+			rhat += vn[n-1];
+			if (rhat >> 32) break;
+		}
+
+		// Multiply and subtract
+		long long k = 0, t;
+		for (int i = 0; i < n; i++) {
+			unsigned long long p = qhat * vn[i];
+			t = (long long) un[i+j] - k - (long long) (p & 0xFFFFFFFFu);
+			un[i+j] = (unsigned) t;
+			k = (long long) (p >> 32) - (t >> 32);
+		}
+		t = (long long) un[j+n] - k;
+		un[j+n] = (unsigned) t;
+
+		// Subtracted too much: add back
+		q[j] = (unsigned) qhat;
+		if (t < 0) {
+			q[j]--;
+			unsigned long long c = 0;
+			for (int i = 0; i < n; i++) {
+				c += (unsigned long long) un[i+j] + vn[i];
+				un[i+j] = (unsigned) c;
+				c >>= 32;
+			}
+			un[j+n] += (unsigned) c;
+		}
+	}
+
+	for (int i = 0; i < n-1; i++) {
+		r[i] = (un[i] >> s) | (s ? un[i+1] << (32-s) : 0);
+	}
+	r[n-1] = un[n-1] >> s;
+	free(vn);
+	free(un);
+}
+
+// Truncating division, as C does for longs: the quotient rounds towards
+// zero and the remainder takes the sign of a. b must not be zero.
+void big_divmod(lbig* a, lbig* b, lbig** q, lbig** r) {
+	if (big_cmp_mag(a, b) < 0) {
+		*q = big_new(0);
+		*r = big_copy(a);
+		return;
+	}
+	if (b->count == 1) {
+		*q = big_copy(a);
+		*r = big_new(1);
+		(*r)->d[0] = big_divmod_small(*q, b->d[0]);
+	}
+	else {
+		*q = big_new(a->count - b->count + 1);
+		*r = big_new(b->count);
+		big_divmod_mag((*q)->d, (*r)->d, a->d, b->d, a->count, b->count);
+	}
+	(*q)->sign = a->sign * b->sign;
+	(*r)->sign = a->sign;
+	big_trim(*q);
+	big_trim(*r);
+}
+
+lbig* big_from_str(char* s) {
+	int sign = 1;
+	if (*s == '-') {
+		sign = -1;
+		s++;
+	}
+
+	// Nine decimal digits at a time
+	lbig* b = big_new(strlen(s) / 9 + 2);
+	b->count = 0;
+	while (*s) {
+		unsigned chunk = 0, scale = 1;
+		for (int i = 0; i < 9 && *s; i++, s++) {
+			chunk = chunk * 10 + (*s - '0');
+			scale *= 10;
+		}
+		unsigned long long c = chunk;
+		for (int i = 0; i < b->count; i++) {
+			c += (unsigned long long) b->d[i] * scale;
+			b->d[i] = (unsigned) c;
+			c >>= 32;
+		}
+		if (c) b->d[b->count++] = (unsigned) c;
+	}
+	b->sign = sign;
+	big_trim(b);
+	return b;
+}
+
+void big_print(lbig* b) {
+	// Peel off nine decimal digits at a time, least significant first
+	lbig* x = big_copy(b);
+	int count = 0;
+	unsigned* chunks = malloc(sizeof(unsigned) * (x->count * 10 / 9 + 2));
+	while (x->count) chunks[count++] = big_divmod_small(x, 1000000000u);
+
+	if (b->sign < 0) putchar('-');
+	printf("%u", count ? chunks[count-1] : 0);
+	for (int i = count-2; i >= 0; i--) printf("%09u", chunks[i]);
+	free(chunks);
+	big_del(x);
+}
+
+// Numbers. Arithmetic on longs is checked for overflow and carries on in a
+// bignum when it happens; bignum results that fit back in a long become
+// longs again.
+Num num_from_big(lbig* b) {
+	Num n;
+	big_trim(b);
+	if (b->count <= 2) {
+		unsigned long long m = b->count ? b->d[0] : 0;
+		if (b->count == 2) m |= (unsigned long long) b->d[1] << 32;
+		if (b->sign > 0 ? m <= LONG_MAX : m <= (unsigned long long) LONG_MAX + 1) {
+			n.type = LONG;
+			n.l = b->sign > 0 ? (long) m : (long) -m;
+			big_del(b);
+			return n;
+		}
+	}
+	n.type = BIG;
+	n.b = b;
+	return n;
+}
+
+Num num_copy(Num n) {
+	if (n.type == BIG) n.b = big_copy(n.b);
+	return n;
+}
+
+void num_clear(Num* n) {
+	if (n->type == BIG) big_del(n->b);
+	n->type = LONG;
+	n->l = 0;
+}
+
+double num_to_double(Num n) {
+	switch (n.type) {
+		case LONG: return n.l;
+		case BIG: return big_to_double(n.b);
+	}
+	return n.d;
+}
+
+int num_is_zero(Num n) {
+	return n.type == DOUBLE ? n.d == 0 : n.type == LONG && n.l == 0;
+}
+
+int num_cmp(Num x, Num y) {
+	if (x.type == LONG && y.type == LONG) return (x.l > y.l) - (x.l < y.l);
+	if (x.type == BIG && y.type == BIG) return big_cmp(x.b, y.b);
+	// A bignum is beyond the range of any long
+	if (x.type == BIG && y.type == LONG) return x.b->sign;
+	if (x.type == LONG && y.type == BIG) return -y.b->sign;
+	double a = num_to_double(x), b = num_to_double(y);
+	return a < b ? -1 : a > b ? 1 : 0;
+}
+
+// x = x op y on longs. Returns 1, leaving x alone, if the result
+// overflows, and -1 on division by zero.
+int long_arith(char op, long* x, long y) {
+	long r;
+	switch (op) {
+		case '+': if (__builtin_add_overflow(*x, y, &r)) return 1; break;
+		case '-': if (__builtin_sub_overflow(*x, y, &r)) return 1; break;
+		case '*': if (__builtin_mul_overflow(*x, y, &r)) return 1; break;
+		case '/':
+			if (y == 0) return -1;
+			if (*x == LONG_MIN && y == -1) return 1;
+			r = *x / y;
+		break;
+		default:
+			if (y == 0) return -1;
+			r = y == -1 ? 0 : *x % y;
+		break;
+	}
+	*x = r;
+	return 0;
+}
+
+// Apply op (one of + - * / %) to x and y, leaving the result in x.
+// Returns -1, leaving x alone, on division by zero.
+int num_arith(char op, Num* x, Num y) {
+	if ((op == '/' || op == '%') && num_is_zero(y)) return -1;
+
+	if (x->type == DOUBLE || y.type == DOUBLE) {
+		double a = num_to_double(*x), b = num_to_double(y);
+		num_clear(x);
+		x->type = DOUBLE;
+		switch (op) {
+			case '+': x->d = a + b; break;
+			case '-': x->d = a - b; break;
+			case '*': x->d = a * b; break;
+			case '/': x->d = a / b; break;
+			case '%': x->d = fmod(a, b); break;
+		}
+		return 0;
+	}
+
+	if (x->type == LONG && y.type == LONG && long_arith(op, &x->l, y.l) == 0) {
+		return 0;
+	}
+
+	// Overflowed, or there is a bignum operand
+	lbig* a = x->type == BIG ? x->b : big_from_long(x->l);
+	lbig* b = y.type == BIG ? y.b : big_from_long(y.l);
+	lbig* r;
+	lbig* q;
+	switch (op) {
+		case '+': r = big_add(a, b); break;
+		case '-': r = big_sub(a, b); break;
+		case '*': r = big_mul(a, b); break;
+		case '/': big_divmod(a, b, &r, &q); big_del(q); break;
+		default: big_divmod(a, b, &q, &r); big_del(q); break;
+	}
+	if (y.type != BIG) big_del(b);
+	if (x->type != BIG) big_del(a);
+	num_clear(x);
+	*x = num_from_big(r);
+	return 0;
+}
+
+void num_neg(Num* x) {
+	switch (x->type) {
+		case LONG:
+			if (x->l != LONG_MIN) {
+				x->l = -x->l;
+				break;
+			}
+			x->b = big_from_long(x->l);
+			x->type = BIG;
+			// fall through
+		case BIG:
+			x->b->sign = -x->b->sign;
+			*x = num_from_big(x->b);
+		break;
+		case DOUBLE: x->d = -x->d; break;
+	}
+}
+
+// Raise x to the power y >= 0, integers by repeated squaring. Doubles go
+// to pow, as squaring doubles the rounding error at every step.
+void num_pow(Num* x, long y) {
+	if (x->type == DOUBLE) {
+		x->d = pow(x->d, (double) y);
+		return;
+	}
+	Num r;
+	r.type = LONG;
+	r.l = 1;
+	Num base = *x;
+	while (y) {
+		if (y & 1) num_arith('*', &r, base);
+		y >>= 1;
+		if (y) num_arith('*', &base, base);
+	}
+	num_clear(&base);
+	*x = r;
 }
 
 int valid_math_input(lval* v) {
@@ -576,373 +2884,1375 @@ int valid_math_input(lval* v) {
 }
 
 lval* builtin_add(lenv* e, lval* a) {
-    LASSERT(a, valid_math_input(a), "'+' requires all numerical inputs");
-    lval* x = lval_pop(a,0);
-    
-    while (a->count) {
-        lval* y = lval_pop(a,0);
-        
-        if (x->num.type == LONG && y->num.type == LONG) {
-            x->num.l += y->num.l;
-        }
-        else if (x->num.type == LONG && y->num.type == DOUBLE) {
-            x->num.type = DOUBLE;
-            x->num.d = x->num.l + y->num.d;
+    return builtin_op(e, a, '+');
+}
+
+lval* builtin_sub(lenv* e, lval* a) {
+    return builtin_op(e, a, '-');
+}
+
+lval* builtin_mul(lenv* e, lval* a) {
+    return builtin_op(e, a, '*');
+}
+
+lval* builtin_div(lenv* e, lval* a) {
+    return builtin_op(e, a, '/');
+}
+
+lval* builtin_mod(lenv* e, lval* a) {
+    return builtin_op(e, a, '%');
+}
+
+// Walks the arguments once, in place. The result is kept in a long while
+// the arguments are longs and in a double once one of them is a double;
+// only bignums and overflow go through num_arith.
+lval* builtin_op(lenv* e, lval* a, char op) {
+    int i = 1;
+    Num x;
+    x.type = LONG;
+    x.l = 0;
+    if (a->count == 0 || a->cell[0]->type != LVAL_NUM) goto invalid;
+    x = num_copy(a->cell[0]->num);
+
+    // (- x) negates
+    if (op == '-' && a->count == 1) num_neg(&x);
+
+    if (x.type == LONG) {
+        for (; i < a->count; i++) {
+            lval* y = a->cell[i];
+            if (y->type != LVAL_NUM) goto invalid;
+            if (y->num.type != LONG) break;
+            int r = long_arith(op, &x.l, y->num.l);
+            if (r < 0) goto zero;
+            if (r > 0) break;
         }
-        else if (x->num.type == DOUBLE && y->num.type == LONG) {
-            x->num.d += y->num.l;
+        if (i < a->count && a->cell[i]->num.type == DOUBLE) {
+            x.d = x.l;
+            x.type = DOUBLE;
         }
-        else {
-            x->num.d += y->num.d;
+    }
+
+    if (x.type == DOUBLE) {
+        double d = x.d;
+        for (; i < a->count; i++) {
+            lval* y = a->cell[i];
+            if (y->type != LVAL_NUM) goto invalid;
+            if ((op == '/' || op == '%') && num_is_zero(y->num)) goto zero;
+            double b = num_to_double(y->num);
+            switch (op) {
+                case '+': d += b; break;
+                case '-': d -= b; break;
+                case '*': d *= b; break;
+                case '/': d /= b; break;
+                case '%': d = fmod(d, b); break;
+            }
         }
-        
-        lval_del(y);
+        x.d = d;
     }
-    
+
+    // A long overflowed or a bignum turned up
+    for (; i < a->count; i++) {
+        lval* y = a->cell[i];
+        if (y->type != LVAL_NUM) goto invalid;
+        if (num_arith(op, &x, y->num) < 0) goto zero;
+    }
+
     lval_del(a);
-    return x;
-}
+    return lval_num(x);
 
-lval* builtin_sub(lenv* e, lval* a) {
-    LASSERT(a, valid_math_input(a), "'-' requires all numerical inputs");
-    lval* x = lval_pop(a,0);
-    
-    if (a->count == 0) {
-        if (x->num.type == LONG) {
-            x->num.l = -x->num.l;
-        }
-        else {
-            x->num.d = -x->num.d;
-        }
+zero:
+    // A later non-number takes precedence, as it always has
+    if (valid_math_input(a)) {
+        num_clear(&x);
         lval_del(a);
-        return x;
+        return lval_err("division by zero");
     }
+invalid:
+    num_clear(&x);
+    lval_del(a);
+    return lval_err("'%c' requires all numerical inputs", op);
+}
+
+lval* builtin_exp(lenv* e, lval* a) {
+    LASSERT(a, valid_math_input(a), "'^' requires all numerical inputs");
+    lval* x = lval_own(lval_pop(a,0));
     
     while (a->count) {
         lval* y = lval_pop(a,0);
         
-        if (x->num.type == LONG && y->num.type == LONG) {
-            x->num.l -= y->num.l;
-        }
-        else if (x->num.type == LONG && y->num.type == DOUBLE) {
-            x->num.type = DOUBLE;
-            x->num.d = x->num.l - y->num.d;
-        }
-        else if (x->num.type == DOUBLE && y->num.type == LONG) {
-            x->num.d -= y->num.l;
+        if (y->num.type == DOUBLE) {
+            lval_del(x); lval_del(y); lval_del(a);
+            return lval_err("exponentiation by non-integer not supported yet. "
+										"Got %f, of type double, as an exponent.", y->num.d);
         }
-        else {
-            x->num.d -= y->num.d;
+        
+        if (y->num.type == BIG || y->num.l < 0) {
+            int negative = y->num.type == BIG ? y->num.b->sign < 0 : 1;
+            lval_del(x); lval_del(y); lval_del(a);
+            return negative ?
+                lval_err("exponentiation by negative exponent not supported yet.") :
+                lval_err("exponent too large.");
         }
         
+        num_pow(&x->num, y->num.l);
         lval_del(y);
     }
     
-    lval_del(a);
-    return x;
+    lval_del(a); return x;
 }
 
-lval* builtin_mul(lenv* e, lval* a) {
-    LASSERT(a, valid_math_input(a), "'*' requires all numerical inputs");
-    lval* x = lval_pop(a,0);
-    
-    while(a->count) {
-        lval* y = lval_pop(a,0);
-        if (x->num.type == LONG) {
-            if (y->num.type == LONG) {
-                x->num.l *= y->num.l;
-            }
-            else {
-                x->num.type = DOUBLE;
-                x->num.d = x->num.l * y->num.d;
-            }
-        }
-        else {
-            if (y->num.type == LONG) {
-                x->num.d *= y->num.l;
-            }
-            else {
-                x->num.d *= y->num.d;
-            }
-        }
+lval* builtin_def(lenv* e, lval* a) {
+	return builtin_var(e,a,sym_def);
+}
 
-        lval_del(y);
-    }
-    
-    lval_del(a); return x;
+lval* builtin_put(lenv* e, lval* a) {
+	return builtin_var(e,a,"=");
 }
 
-lval* builtin_div(lenv* e, lval* a) {
-    LASSERT(a, valid_math_input(a), "'/' requires all numerical inputs");
-    lval* x = lval_pop(a,0);
+lval* builtin_var(lenv* e, lval* a, char* func) {
+		CHECK_INPUT_TYPE(func, a, 0, LVAL_QEXPR);
+   
+    // Symbols to define passed as first argument qexpr
+    lval* syms = a->cell[0];
     
-    while (a->count) {
-        lval* y = lval_pop(a,0);
-        
-        switch (x->num.type) {
-            case LONG:
-                switch (y->num.type) {
-                    case LONG:
-                        if (y->num.l == 0) {
-                            lval_del(x); lval_del(y);
-                            return lval_err("division by zero");
-                        }
-                        x->num.l /= y->num.l;
-										break;
-                    case DOUBLE:
-                        if (y->num.d == 0) {
-                            lval_del(x); lval_del(y);
-                            return lval_err("division by zero");
-                        }
-                        x->num.type = DOUBLE;
-                        x->num.d = x->num.l / y->num.d;
-										break;
-                }
-						break;
-            case DOUBLE:
-                switch (y->num.type) {
-                    case LONG:
-                        if (y->num.l == 0) {
-                            lval_del(x); lval_del(y);
-                            return lval_err("division by zero");
-                        }
-                        x->num.d /= y->num.l;
-										break;
-                    case DOUBLE:
-                        if (y->num.d == 0) {
-                            lval_del(x); lval_del(y);
-                            return lval_err("division by zero");
-                        }
-                        x->num.d /= y->num.d;
-										break;
-                }
-						break;
-        }
-        
-        lval_del(y);
+    // Make sure everything in qexpr is a symbol
+    for (int i = 0; i < syms->count; i++) {
+				LASSERT(a, (syms->cell[i]->type == LVAL_SYM), "Function '%s' cannot "
+						"define non-symbol. Got %s, expected %s.", func,
+						ltype_name(syms->cell[i]->type), ltype_name(LVAL_SYM));
+   }
+    
+    // Make sure number of values matches number of symbols
+    LASSERT(a, syms->count == a->count-1,
+            "Function '%s' received %d symbols and %d values. Mismatch.",
+           func, syms->count, a->count-1);
+    
+    for (int i = 0; i < syms->count; i++) {
+				lval* val = lenv_get(e, syms->cell[i]);
+				if (val->type == LVAL_FUN && val->builtin != NULL) {
+					lval_del(a); lval_del(val);
+					return lval_err("attempting to redefine builtin function.");
+				}
+				lval_del(val);
+
+				// func is only ever the interned "def" when called from builtin_def
+				if (func == sym_def) {
+					lenv_def(e, syms->cell[i], a->cell[i+1]);
+				}
+				else {
+					if (e->par) lenv_shadow(syms->cell[i]->sym);
+					lenv_put(e, syms->cell[i], a->cell[i+1]);
+				}
     }
     
-    lval_del(a); return x;
+    lval_del(a);
+    return lval_sexpr();
+}
+
+lval* lval_call(lenv* e, lval* f, lval* a) {
+	if (f->builtin) return f->builtin(e,a);
+
+	return lval_apply(e, lval_ref(f), a);
+}
+
+// Functions are never modified by a call. Arguments are bound into a new
+// frame, in formal order after any bound by earlier partial applications
+// (kept in f->env). If formals remain, the result is a new function that
+// records the frame and how many formals it binds; otherwise *frame is set
+// and NULL returned, and the body can be run in it.
+lval* lval_bind(lenv* e, lval* f, lval* a, lenv** frame) {
+	lenv* env = f->env ? lenv_copy(f->env) : lenv_new();
+	lval* formals = f->formals;
+	int next = f->bound;
+
+	// With distinct formals, each one is bound in a fresh slot, in order
+	void (*bind)(lenv*, lval*, lval*) = f->code && f->code->nparams ?
+		lenv_push : lenv_put;
+
+	// Record argument counts
+	int given = a->count;
+	int total = formals->count - f->bound;
+
+	while (a->count) {
+		if (next == formals->count) {
+			lval_del(a); lenv_del(env);
+			return lval_err("Function passed too many arguments. Got %i, expected "
+					"%i", given, total);
+		}
+
+		// Take the next symbol from formals
+		lval* sym = formals->cell[next++];
+
+		// Adding way to deal with variable number of arguments
+		if (sym->sym == sym_amp) {
+			// Ensure "&" is followed by another symbol
+			if (formals->count - next != 1) {
+				lval_del(a); lenv_del(env);
+				return lval_err("Function format invalid. Symbol '&' not followed by "
+						"single symbol");
+			}
+
+			// Bind next formal to remaining arguments
+			lval* nsym = formals->cell[next++];
+			bind(env, nsym, builtin_list(e,a));
+			break;
+		}
+		// Pop next argument from the list
+		lval* val = lval_pop(a,0);
+		// Bind it into the frame
+		bind(env, sym, val);
+		lval_del(val);
+	}
+
+	lval_del(a);
+	// If '&' remains in formal list, bind to empty list
+	if (next < formals->count && formals->cell[next]->sym == sym_amp) {
+		// Check that '&' is passed with one other symbol
+		if (formals->count - next != 2) {
+			lenv_del(env);
+			return lval_err("Function format invalid. Symbol '&' not followed by "
+					"single symbol.");
+		}
+
+		// Skip '&' and bind the next symbol to an empty list
+		lval* sym = formals->cell[next+1];
+		lval* val = lval_qexpr();
+		bind(env, sym, val);
+		lval_del(val);
+		next = formals->count;
+	}
+	// If all formals have been bound, the body is ready to be evaluated
+	else if (next == formals->count) {
+		*frame = env;
+		return NULL;
+	}
+
+	// Partial application
+	lval* p = lval_alloc();
+	p->type = LVAL_FUN;
+	p->ref = 1;
+	p->builtin = NULL;
+	p->env = env;
+	p->bound = next;
+	p->formals = lval_ref(formals);
+	p->body = lval_ref(f->body);
+	p->code = f->code;
+	if (p->code) p->code->ref++;
+	return p;
+}
+
+// Lambda bodies are compiled once, when the lambda is created, into a
+// flat instruction stream run by vm_run. Compiled code evaluates exactly
+// as the tree walker in lval_apply would: symbols are still looked up by
+// name at run time (scoping is dynamic), but the body is no longer copied
+// and re-walked on every call. (if c {a} {b}) with literal branches is
+// compiled into a conditional jump, guarded at run time by checking that
+// 'if' really is the builtin and c a boolean.
+//
+// Parameters are the exception to lookup by name. When a lambda's formals
+// are distinct, lval_bind binds formal i into slot i of the frame's
+// environment, and the body is always run with the frame as its
+// environment, so a parameter is read straight from its slot. The slot's
+// symbol is checked before use, in case the frame was built some other way.
+enum {
+	OP_CONST,    // k: push constant k
+	OP_LOOKUP,   // k c: push the value of symbol constant k, using cache c
+	OP_LOCAL,    // k i: push slot i of the frame, which binds symbol k
+	OP_CALL,     // n k: apply the function below n arguments to them; k is
+	             // the symbol it was named by, or -1
+	OP_TAILCALL, // n k: as OP_CALL, but hand the call back to lval_apply
+	OP_REEVAL,   // evaluate the top of the stack again
+	OP_IF,       // then else pc_else pc_end: branch on the condition
+	OP_JUNCTION, // b i n pc_end: operand i of n of && (b false) or || (b true)
+	OP_JUMP,     // pc: continue at pc
+	OP_RETURN    // return the top of the stack
+};
+
+typedef struct lcompiler {
+	lcode* code;
+	lval* formals;
+	int size;
+	int consts_size;
+	int depth;
+} lcompiler;
+
+void lcode_emit(lcompiler* c, int op) {
+	lcode* code = c->code;
+	if (code->count == c->size) {
+		c->size = c->size ? c->size * 2 : 16;
+		code->ops = realloc(code->ops, sizeof(int) * c->size);
+	}
+	code->ops[code->count++] = op;
+}
+
+int lcode_const(lcompiler* c, lval* v) {
+	lcode* code = c->code;
+	if (code->nconsts == c->consts_size) {
+		c->consts_size = c->consts_size ? c->consts_size * 2 : 8;
+		code->consts = realloc(code->consts, sizeof(lval*) * c->consts_size);
+	}
+	code->consts[code->nconsts] = lval_ref(v);
+	return code->nconsts++;
+}
+
+void lcode_push(lcompiler* c, int n) {
+	c->depth += n;
+	if (c->depth > c->code->max_stack) c->code->max_stack = c->depth;
+}
+
+void lcode_compile_expr(lcompiler* c, lval* x);
+
+// Compile the cells of an s-expression (or of a q-expression evaluated as
+// one), leaving its value on the stack
+void lcode_compile_sexpr(lcompiler* c, lval* x, int tail) {
+	if (x->count == 0) {
+		lval* empty = lval_sexpr();
+		lcode_emit(c, OP_CONST);
+		lcode_emit(c, lcode_const(c, empty));
+		lval_del(empty);
+		lcode_push(c, 1);
+		return;
+	}
+
+	if (x->count == 1) {
+		lcode_compile_expr(c, x->cell[0]);
+		lcode_emit(c, OP_REEVAL);
+		return;
+	}
+
+	if (x->count == 4 && x->cell[0]->type == LVAL_SYM &&
+			x->cell[0]->sym == sym_if && x->cell[2]->type == LVAL_QEXPR &&
+			x->cell[3]->type == LVAL_QEXPR) {
+		lcode_compile_expr(c, x->cell[0]);
+		lcode_compile_expr(c, x->cell[1]);
+		lcode_emit(c, OP_IF);
+		lcode_emit(c, lcode_const(c, x->cell[2]));
+		lcode_emit(c, lcode_const(c, x->cell[3]));
+		int patch = c->code->count;
+		lcode_emit(c, 0);
+		lcode_emit(c, 0);
+		c->depth -= 2;
+
+		lcode_compile_sexpr(c, x->cell[2], tail);
+		lcode_emit(c, OP_JUMP);
+		int patch_jump = c->code->count;
+		lcode_emit(c, 0);
+		c->depth--;
+
+		c->code->ops[patch] = c->code->count;
+		lcode_compile_sexpr(c, x->cell[3], tail);
+		c->code->ops[patch+1] = c->code->count;
+		c->code->ops[patch_jump] = c->code->count;
+		return;
+	}
+
+	// (&& a b ...) and (|| a b ...) are compiled as ordinary calls with a
+	// check after each operand. If the function is the builtin, the check
+	// decides the result as soon as it can and skips the rest.
+	if (x->count > 2 && x->cell[0]->type == LVAL_SYM &&
+			(x->cell[0]->sym == sym_and || x->cell[0]->sym == sym_or)) {
+		int n = x->count-1;
+		int patch[n];
+		lcode_compile_expr(c, x->cell[0]);
+		for (int i = 0; i < n; i++) {
+			lcode_compile_expr(c, x->cell[i+1]);
+			lcode_emit(c, OP_JUNCTION);
+			lcode_emit(c, x->cell[0]->sym == sym_or);
+			lcode_emit(c, i);
+			lcode_emit(c, n);
+			patch[i] = c->code->count;
+			lcode_emit(c, 0);
+		}
+		lcode_emit(c, tail ? OP_TAILCALL : OP_CALL);
+		lcode_emit(c, n);
+		lcode_emit(c, lcode_const(c, x->cell[0]));
+		c->depth -= n;
+		for (int i = 0; i < n; i++) c->code->ops[patch[i]] = c->code->count;
+		return;
+	}
+
+	for (int i = 0; i < x->count; i++) {
+		lcode_compile_expr(c, x->cell[i]);
+	}
+	lcode_emit(c, tail ? OP_TAILCALL : OP_CALL);
+	lcode_emit(c, x->count-1);
+	lcode_emit(c, x->cell[0]->type == LVAL_SYM ? lcode_const(c, x->cell[0]) : -1);
+	c->depth -= x->count-1;
+}
+
+// Slot a parameter is bound in, or -1 if sym isn't one
+int lcode_slot(lcompiler* c, char* sym) {
+	int slot = 0;
+	for (int i = 0; i < c->code->nparams; i++) {
+		if (c->formals->cell[i]->sym == sym_amp) continue;
+		if (c->formals->cell[i]->sym == sym) return slot;
+		slot++;
+	}
+	return -1;
+}
+
+void lcode_compile_expr(lcompiler* c, lval* x) {
+	int slot;
+	switch (x->type) {
+		case LVAL_SYM:
+			slot = lcode_slot(c, x->sym);
+			lcode_emit(c, slot >= 0 ? OP_LOCAL : OP_LOOKUP);
+			lcode_emit(c, lcode_const(c, x));
+			lcode_emit(c, slot >= 0 ? slot : c->code->ncaches++);
+			lcode_push(c, 1);
+		break;
+		case LVAL_SEXPR:
+			lcode_compile_sexpr(c, x, FALSE);
+		break;
+		default:
+			lcode_emit(c, OP_CONST);
+			lcode_emit(c, lcode_const(c, x));
+			lcode_push(c, 1);
+		break;
+	}
+}
+
+lcode* lcode_compile(lval* formals, lval* body) {
+	lcompiler c;
+	c.formals = formals;
+	c.code = malloc(sizeof(lcode));
+	c.code->ref = 1;
+	c.code->count = 0;
+	c.code->ops = NULL;
+	c.code->nconsts = 0;
+	c.code->consts = NULL;
+	c.code->max_stack = 0;
+	c.code->ncaches = 0;
+	c.code->calls = 0;
+	c.code->jit = NULL;
+	c.code->jit_size = 0;
+	c.code->nfolded = 0;
+	c.code->folded = NULL;
+	c.code->unfolded = NULL;
+	c.code->nparams = formals->count;
+	for (int i = 0; i < formals->count; i++) {
+		for (int j = 0; j < i; j++) {
+			if (formals->cell[i]->sym == formals->cell[j]->sym) c.code->nparams = 0;
+		}
+	}
+	c.size = 0;
+	c.consts_size = 0;
+	c.depth = 0;
+
+	lcode_compile_sexpr(&c, body, TRUE);
+	lcode_emit(&c, OP_RETURN);
+
+	// Version 0 is never current, so every cache starts out empty
+	c.code->caches = calloc(c.code->ncaches ? c.code->ncaches : 1, sizeof(lcache));
+	return c.code;
+}
+
+void lcode_del(lcode* code) {
+	if (!code || --code->ref > 0) return;
+	for (int i = 0; i < code->nconsts; i++) lval_del(code->consts[i]);
+	free(code->consts);
+	free(code->ops);
+	free(code->caches);
+	free(code->folded);
+	lcode_del(code->unfolded);
+	jit_free(code);
+	free(code);
+}
+
+// The code to run for fn: its compiled body, or if a builtin that body
+// had folded away has since been bound outside the global environment,
+// the body compiled as written. The set of such symbols only grows, so
+// once stale, code stays stale; until then it is rechecked only when
+// lenv_version moves.
+lcode* lcode_current(lval* fn) {
+	lcode* code = fn->code;
+	if (code->unfolded) return code->unfolded;
+	if (!code->nfolded || code->fold_version == lenv_version) return code;
+	for (int i = 0; i < code->nfolded; i++) {
+		if (lenv_shadowed(code->folded[i])) {
+			code->unfolded = lcode_compile(fn->formals, fn->body);
+			return code->unfolded;
+		}
+	}
+	code->fold_version = lenv_version;
+	return code;
+}
+
+// Words for the VM's stack. Without LISPR_NANBOX a word is just the lval*,
+// and these convert nothing.
+
+// Word for v, taking over the caller's reference to it
+lword word_from_lval(lval* v) {
+#ifdef LISPR_NANBOX
+	lword w;
+	switch (v->type) {
+		case LVAL_NUM:
+			if (v->num.type == BIG ||
+					(v->num.type == LONG && (v->num.l < NB_INT_MIN || v->num.l > NB_INT_MAX))) {
+				return (lword) v;
+			}
+			w = word_from_num(v->num);
+		break;
+		case LVAL_BOOL: w = v->bool ? NB_TRUE : NB_FALSE; break;
+		case LVAL_SYM: w = NB_SYM | (lword) (uintptr_t) v->sym; break;
+		default: return v == lval_nil() ? NB_NIL : (lword) v;
+	}
+	lval_del(v);
+	return w;
+#else
+	return v;
+#endif
+}
+
+// The lval for w, which the caller gets a reference to in place of w
+lval* word_to_lval(lword w) {
+#ifdef LISPR_NANBOX
+	switch (w >> 48) {
+		case 0:
+			if (w == NB_TRUE || w == NB_FALSE) return lval_bool(w == NB_TRUE);
+			if (w == NB_NIL) return lval_nil();
+			return (lval*) w;
+		case 1: {
+			lval* v = lval_alloc();
+			v->type = LVAL_SYM;
+			v->ref = 1;
+			v->sym = (char*) (uintptr_t) (w & NB_PAYLOAD);
+			return v;
+		}
+	}
+	Num n;
+	word_num(w, &n);
+	return lval_num(n);
+#else
+	return w;
+#endif
+}
+
+void word_del(lword w) {
+#ifdef LISPR_NANBOX
+	if (w >> 48 == 0 && w > NB_TRUE) lval_del((lval*) w);
+#else
+	lval_del(w);
+#endif
+}
+
+// If w is a long or a double, stores it in n and returns 1
+int word_num(lword w, Num* n) {
+#ifdef LISPR_NANBOX
+	if (w >> 48 == 0xffff) {
+		n->type = LONG;
+		n->l = (long) (w << 16) >> 16;
+		return 1;
+	}
+	if (w >> 48 >= 2) {
+		w -= NB_DOUBLE_OFFSET;
+		n->type = DOUBLE;
+		memcpy(&n->d, &w, sizeof(double));
+		return 1;
+	}
+	if (w >> 48 || w <= NB_TRUE) return 0;
+	lval* v = (lval*) w;
+#else
+	lval* v = w;
+#endif
+	if (v->type != LVAL_NUM || v->num.type == BIG) return 0;
+	*n = v->num;
+	return 1;
+}
+
+// Word for a long or a double
+lword word_from_num(Num n) {
+#ifdef LISPR_NANBOX
+	if (n.type == DOUBLE) {
+		// Every NaN is stored as the same one, so none looks like a tag
+		lword w = 0x7ff8000000000000;
+		if (n.d == n.d) memcpy(&w, &n.d, sizeof(double));
+		return w + NB_DOUBLE_OFFSET;
+	}
+	if (n.l >= NB_INT_MIN && n.l <= NB_INT_MAX) {
+		return NB_INT | ((lword) n.l & NB_PAYLOAD);
+	}
+#endif
+	return (lword) lval_num(n);
+}
+
+// 1 or 0 if w is a boolean, otherwise -1
+int word_bool(lword w) {
+#ifdef LISPR_NANBOX
+	return w == NB_TRUE ? 1 : w == NB_FALSE ? 0 : -1;
+#else
+	return w->type == LVAL_BOOL ? w->bool == TRUE : -1;
+#endif
+}
+
+lword word_from_bool(int b) {
+#ifdef LISPR_NANBOX
+	return b ? NB_TRUE : NB_FALSE;
+#else
+	return lval_bool(b);
+#endif
+}
+
+// The function w holds, or NULL if it isn't one
+lval* word_fun(lword w) {
+#ifdef LISPR_NANBOX
+	if (w >> 48 || w <= NB_TRUE) return NULL;
+#endif
+	lval* v = (lval*) w;
+	return v->type == LVAL_FUN ? v : NULL;
+}
+
+// Pop n values off the top of the stack into a new s-expression
+lval* vm_args(lword* stack, int* sp, int n) {
+	lval* a = lval_sexpr();
+	a->count = n;
+	a->size = n;
+	a->cell = malloc(sizeof(lval*) * n);
+	*sp -= n;
+	for (int i = 0; i < n; i++) a->cell[i] = word_to_lval(stack[*sp + i]);
+	return a;
+}
+
+// Calls of the arithmetic and comparison builtins on two longs or
+// doubles are worked out on the stack, without building an argument list
+// or, for NaN-boxed words, allocating the result. Anything the builtin
+// would do differently (overflow, division by zero, errors) returns 0 so
+// the builtin is called after all.
+int vm_binop(lbuiltin f, lword a, lword b, lword* r) {
+	char op;
+	if (f == builtin_add) op = '+';
+	else if (f == builtin_sub) op = '-';
+	else if (f == builtin_mul) op = '*';
+	else if (f == builtin_div) op = '/';
+	else if (f == builtin_mod) op = '%';
+	else if (f == builtin_greater_than) op = '>';
+	else if (f == builtin_smaller_than) op = '<';
+	else if (f == builtin_greater_than_or_equal_to) op = 'g';
+	else if (f == builtin_smaller_than_or_equal_to) op = 'l';
+	else if (f == builtin_eq) op = '=';
+	else if (f == builtin_ne) op = '!';
+	else return 0;
+
+	Num x, y;
+	if (!word_num(a, &x) || !word_num(b, &y)) return 0;
+
+	switch (op) {
+		case '>': *r = word_from_bool(num_cmp(x, y) > 0); return 1;
+		case '<': *r = word_from_bool(num_cmp(x, y) < 0); return 1;
+		case 'g': *r = word_from_bool(num_cmp(x, y) >= 0); return 1;
+		case 'l': *r = word_from_bool(num_cmp(x, y) <= 0); return 1;
+		case '=': *r = word_from_bool(num_eq(x, y)); return 1;
+		case '!': *r = word_from_bool(!num_eq(x, y)); return 1;
+	}
+
+	if (x.type == LONG && y.type == LONG) {
+		if (long_arith(op, &x.l, y.l) != 0) return 0;
+	}
+	else {
+		if ((op == '/' || op == '%') && num_is_zero(y)) return 0;
+		double d = num_to_double(x), e = num_to_double(y);
+		x.type = DOUBLE;
+		switch (op) {
+			case '+': x.d = d + e; break;
+			case '-': x.d = d - e; break;
+			case '*': x.d = d * e; break;
+			case '/': x.d = d / e; break;
+			case '%': x.d = fmod(d, e); break;
+		}
+	}
+	*r = word_from_num(x);
+	return 1;
+}
+
+// The instructions, one function each, shared by vm_run's loop and by
+// machine code from jit_compile. Each returns 0 to go on with the next
+// instruction and -1 on an error, which is left in m->x. Those that end
+// the body return 1, with the result in m->x (or the tail call in
+// *m->tail_f and *m->tail_a); those that branch return which way.
+// vm_run's loop has them inlined; machine code calls them.
+#define VM_OP __attribute__((always_inline)) inline
+VM_OP int vm_const(lvm* m, int k) {
+	m->stack[m->sp++] = word_from_lval(lval_ref(m->code->consts[k]));
+	return 0;
+}
+
+VM_OP int vm_lookup(lvm* m, int k, int c) {
+	lcache* cache = &m->code->caches[c];
+	lval* x;
+	if (cache->version == lenv_version) {
+		lenv_cache_hits++;
+		x = lval_ref(cache->env->vals[cache->index]);
+	}
+	else {
+		x = lenv_get_cached(m->e, m->code->consts[k], cache);
+		if (x->type == LVAL_ERR) {
+			m->x = x;
+			return -1;
+		}
+	}
+	m->stack[m->sp++] = word_from_lval(x);
+	return 0;
+}
+
+VM_OP int vm_local(lvm* m, int k, int i) {
+	lenv* e = m->e;
+	lval* key = m->code->consts[k];
+	lval* x = i < e->count && e->syms[i] == key->sym ?
+		lval_ref(e->vals[i]) : lenv_get(e, key);
+	if (x->type == LVAL_ERR) {
+		m->x = x;
+		return -1;
+	}
+	m->stack[m->sp++] = word_from_lval(x);
+	return 0;
+}
+
+// Applies a builtin of two numbers in place. Returns 0 if it doesn't apply.
+VM_OP int vm_call_binop(lvm* m, int n) {
+	lword r;
+	lword* top = m->stack + m->sp;
+	lval* f = word_fun(top[-n-1]);
+	if (n != 2 || !f || !f->builtin || !vm_binop(f->builtin, top[-2], top[-1], &r)) {
+		return 0;
+	}
+	word_del(top[-1]);
+	word_del(top[-2]);
+	lval_del(f);
+	m->sp -= 2;
+	m->stack[m->sp-1] = r;
+	return 1;
+}
+
+VM_OP int vm_call(lvm* m, int n) {
+	if (vm_call_binop(m, n)) return 0;
+	lval* a = vm_args(m->stack, &m->sp, n);
+	lval* f = word_to_lval(m->stack[--m->sp]);
+	lval* x = lval_apply(m->e, f, a);
+	if (x->type == LVAL_ERR) {
+		m->x = x;
+		return -1;
+	}
+	m->stack[m->sp++] = word_from_lval(x);
+	return 0;
+}
+
+VM_OP int vm_tailcall(lvm* m, int n) {
+	// No need to hand back a call that can be made here
+	if (vm_call_binop(m, n)) return vm_return(m);
+	*m->tail_a = vm_args(m->stack, &m->sp, n);
+	*m->tail_f = word_to_lval(m->stack[--m->sp]);
+	m->x = NULL;
+	return 1;
+}
+
+VM_OP int vm_reeval(lvm* m) {
+	lval* x = lval_eval(m->e, word_to_lval(m->stack[--m->sp]));
+	if (x->type == LVAL_ERR) {
+		m->x = x;
+		return -1;
+	}
+	m->stack[m->sp++] = word_from_lval(x);
+	return 0;
+}
+
+// 0 to run the then branch, 1 the else branch, or 2 to skip both when the
+// call was made as written
+VM_OP int vm_if(lvm* m, int k_then, int k_else) {
+	lword cond = m->stack[--m->sp];
+	lval* f = word_fun(m->stack[m->sp-1]);
+	if (f && f->builtin == builtin_if && word_bool(cond) >= 0) {
+		int b = word_bool(cond);
+		word_del(cond); word_del(m->stack[--m->sp]);
+		return !b;
+	}
+
+	// Not the builtin if, or an error to report: make the call as
+	// written
+	lval* x = lval_add(lval_add(lval_add(lval_sexpr(), word_to_lval(cond)),
+				lval_ref(m->code->consts[k_then])), lval_ref(m->code->consts[k_else]));
+	x = lval_apply(m->e, word_to_lval(m->stack[--m->sp]), x);
+	if (x->type == LVAL_ERR) {
+		m->x = x;
+		return -1;
+	}
+	m->stack[m->sp++] = word_from_lval(x);
+	return 2;
+}
+
+// 1 if the operand decides the result, which then replaces the call
+VM_OP int vm_junction(lvm* m, int stop, int i, int n) {
+	lval* f = word_fun(m->stack[m->sp-i-2]);
+	if (!f || f->builtin != (stop ? builtin_or : builtin_and)) return 0;
+
+	int b = word_bool(m->stack[m->sp-1]);
+	if (b < 0) {
+		lval* y = word_to_lval(m->stack[--m->sp]);
+		m->x = lval_junction_err(f->builtin, i, y->type);
+		lval_del(y);
+		return -1;
+	}
+	if (b != stop && i < n-1) return 0;
+
+	lword r = m->stack[--m->sp];
+	while (i-- > 0) word_del(m->stack[--m->sp]);
+	word_del(m->stack[m->sp-1]);
+	m->stack[m->sp-1] = r;
+	return 1;
+}
+
+VM_OP int vm_return(lvm* m) {
+	m->x = word_to_lval(m->stack[--m->sp]);
+	return 1;
+}
+
+int vm_jit_enabled = TRUE;
+
+lval* vm_run(lenv* e, lcode* code, lval** tail_f, lval** tail_a) {
+	lword stack[code->max_stack + 1];
+	lvm m;
+	m.e = e;
+	m.code = code;
+	m.stack = stack;
+	m.sp = 0;
+	m.x = NULL;
+	m.tail_f = tail_f;
+	m.tail_a = tail_a;
+	*tail_f = NULL;
+
+	int r = 0;
+	if (!code->jit && vm_jit_enabled && ++code->calls == JIT_THRESHOLD) {
+		jit_compile(code);
+	}
+	if (code->jit) {
+		r = ((int (*)(lvm*)) code->jit)(&m);
+	}
+
+	int pc = 0;
+	while (r == 0) {
+		int* op = code->ops + pc;
+		switch (op[0]) {
+			case OP_CONST: r = vm_const(&m, op[1]); pc += 2; break;
+			case OP_LOOKUP: r = vm_lookup(&m, op[1], op[2]); pc += 3; break;
+			case OP_LOCAL: r = vm_local(&m, op[1], op[2]); pc += 3; break;
+			case OP_CALL: r = vm_call(&m, op[1]); pc += 3; break;
+			case OP_TAILCALL: r = vm_tailcall(&m, op[1]); break;
+			case OP_REEVAL: r = vm_reeval(&m); pc += 1; break;
+			case OP_IF:
+				r = vm_if(&m, op[1], op[2]);
+				pc = r == 1 ? op[3] : r == 2 ? op[4] : pc + 5;
+				if (r > 0) r = 0;
+			break;
+			case OP_JUNCTION:
+				r = vm_junction(&m, op[1], op[2], op[3]);
+				pc = r == 1 ? op[4] : pc + 5;
+				if (r > 0) r = 0;
+			break;
+			case OP_JUMP: pc = op[1]; break;
+			case OP_RETURN: r = vm_return(&m); break;
+		}
+	}
+
+	// Any error aborts the whole body, as it would in the tree walker
+	if (r < 0) {
+		while (m.sp) word_del(stack[--m.sp]);
+	}
+	return m.x;
+}
+
+// Releases v, whose count machine code has just taken to 0
+void vm_free(lval* v) {
+	v->ref = 1;
+	lval_del(v);
+}
+
+long jit_compiled = 0;
+long jit_bytes = 0;
+
+#ifdef LISPR_JIT
+// Template compiler for hot bodies, to x86-64. Each instruction becomes a
+// call of the vm_* function that runs it in the interpreter, with its
+// operands as immediates, and jumps become native jumps, so there is no
+// dispatch left. Calls of + - * and the comparisons on two arguments also
+// get an inline path for two LONGs, or two DOUBLEs, guarded on the
+// function being the builtin and on the tags of the arguments (without
+// LISPR_NANBOX, results other than small ints and bools are boxed by a
+// call). When a guard fails the call is made through vm_call as usual.
+//
+// rbx holds the lvm throughout, and r12-r14 the function and arguments of
+// an inline call. Machine code returns the value of the vm_* function that
+// ended it: 1 once the body has finished and -1 on an error.
+typedef struct ljit {
+	unsigned char* buf;
+	int len;
+	int size;
+	int* native;   // Offset of each instruction's code, by pc
+	int* fixups;   // Pairs of rel32 offset and the pc it jumps to
+	int nfixups;
+	int epilogue;  // rel32 offsets jumping to the end, chained through them
+} ljit;
+
+void jit_byte(ljit* j, int b) {
+	if (j->len == j->size) {
+		j->size *= 2;
+		j->buf = realloc(j->buf, j->size);
+	}
+	j->buf[j->len++] = b;
+}
+
+void jit_emit(ljit* j, int n, ...) {
+	va_list ap;
+	va_start(ap, n);
+	for (int i = 0; i < n; i++) jit_byte(j, va_arg(ap, int));
+	va_end(ap);
+}
+
+void jit_imm32(ljit* j, int v) {
+	for (int i = 0; i < 4; i++) jit_byte(j, (v >> (8*i)) & 0xff);
+}
+
+void jit_imm64(ljit* j, uint64_t v) {
+	for (int i = 0; i < 8; i++) jit_byte(j, (v >> (8*i)) & 0xff);
+}
+
+// Conditional jump (jcc 0x80-0x8f, or jmp for -1) to be landed later;
+// returns where its rel32 is
+int jit_jump(ljit* j, int cc) {
+	if (cc < 0) {
+		jit_byte(j, 0xe9);
+	}
+	else {
+		jit_emit(j, 2, 0x0f, cc);
+	}
+	jit_imm32(j, 0);
+	return j->len - 4;
 }
 
-lval* builtin_mod(lenv* e, lval* a) {
-    LASSERT(a, valid_math_input(a), "'%' requires all numerical inputs");
-    lval* x = lval_pop(a,0);
-    
-    while (a->count) {
-        lval* y = lval_pop(a,0);
-        
-        switch (x->num.type) {
-            case LONG:
-                switch (y->num.type) {
-                    case LONG:
-                        if (y->num.l == 0) {
-                            lval_del(x); lval_del(y);
-                            return lval_err("division by zero");
-                        }
-                        x->num.l %= y->num.l;
-										break;
-                    case DOUBLE:
-                        if (y->num.d == 0) {
-                            lval_del(x); lval_del(y);
-                            return lval_err("division by zero");
-                        }
-                        x->num.type = DOUBLE;
-                        x->num.d = fmod(x->num.l, y->num.d);
-										break;
-                }
-						break;
-            case DOUBLE:
-                switch (y->num.type) {
-                    case LONG:
-                        if (y->num.l == 0) {
-                            lval_del(x); lval_del(y);
-                            return lval_err("division by zero");
-                        }
-                        x->num.d = fmod(x->num.d, y->num.l);
-										break;
-                    case DOUBLE:
-                        if (y->num.d == 0) {
-                            lval_del(x); lval_del(y);
-                            return lval_err("division by zero");
-                        }
-                        x->num.d = fmod(x->num.d, y->num.d);
-										break;
-                }
-						break;
-        }
-        
-        lval_del(y);
-    }
-    
-    lval_del(a); return x;
+void jit_land_at(ljit* j, int at, int to) {
+	int rel = to - (at + 4);
+	memcpy(j->buf + at, &rel, 4);
 }
 
-lval* builtin_exp(lenv* e, lval* a) {
-    LASSERT(a, valid_math_input(a), "'^' requires all numerical inputs");
-    lval* x = lval_pop(a,0);
-    
-    while (a->count) {
-        lval* y = lval_pop(a,0);
-        
-        if (y->num.type == DOUBLE) {
-            lval_del(x); lval_del(y);
-            return lval_err("exponentiation by non-integer not supported yet. "
-										"Got %f, of type double, as an exponent.", y->num.type);
-        }
-        
-        if (y->num.l < 0) {
-            lval_del(x); lval_del(y);
-            return lval_err("exponentiation by negative exponent not supported yet. "
-										"Got %ld as an exponent.", y->num.l);
-        }
-        
-        Num n;
-        long l;
-        double d;
-        switch (x->num.type) {
-            case LONG:
-                l = 1;
-                for (long i = 0; i < y->num.l; i++) {
-                    l *= x->num.l;
-                }
-                n.type = LONG;
-                n.l = l;
-                lval_del(x);
-                x = lval_num(n);
-						break;
-            case DOUBLE:
-                d = 1;
-                for (long i = 0; i < y->num.l; i++) {
-                    d *= x->num.d;
-                }
-                n.type = DOUBLE;
-                n.d = d;
-                lval_del(x);
-                x = lval_num(n);
-						break;
-        }
-        
-        lval_del(y);
-    }
-    
-    lval_del(a); return x;
+void jit_land(ljit* j, int at) {
+	jit_land_at(j, at, j->len);
 }
 
-lval* builtin_def(lenv* e, lval* a) {
-	return builtin_var(e,a,"def");
+void jit_jump_pc(ljit* j, int cc, int pc) {
+	int at = jit_jump(j, cc);
+	if (j->nfixups % 64 == 0) {
+		j->fixups = realloc(j->fixups, sizeof(int) * 2 * (j->nfixups + 64));
+	}
+	j->fixups[2*j->nfixups] = at;
+	j->fixups[2*j->nfixups+1] = pc;
+	j->nfixups++;
 }
 
-lval* builtin_put(lenv* e, lval* a) {
-	return builtin_var(e,a,"=");
+void jit_jump_end(ljit* j, int cc) {
+	int at = jit_jump(j, cc);
+	memcpy(j->buf + at, &j->epilogue, 4);
+	j->epilogue = at;
 }
 
-lval* builtin_var(lenv* e, lval* a, char* func) {
-		CHECK_INPUT_TYPE(func, a, 0, LVAL_QEXPR);
-   
-    // Symbols to define passed as first argument qexpr
-    lval* syms = a->cell[0];
-    
-    // Make sure everything in qexpr is a symbol
-    for (int i = 0; i < syms->count; i++) {
-				LASSERT(a, (syms->cell[i]->type == LVAL_SYM), "Function '%s' cannot "
-						"define non-symbol. Got %s, expected %s.", func,
-						ltype_name(syms->cell[i]->type), ltype_name(LVAL_SYM));
-   }
-    
-    // Make sure number of values matches number of symbols
-    LASSERT(a, syms->count == a->count-1,
-            "Function '%s' received %d symbols and %d values. Mismatch.",
-           func, syms->count, a->count-1);
-    
-    for (int i = 0; i < syms->count; i++) {
-				lval* val = lenv_get(e, syms->cell[i]);
-				if (val->type == LVAL_FUN && val->builtin != NULL) {
-					lval_del(a); lval_del(val);
-					return lval_err("attempting to redefine builtin function.");
-				}
-				lval_del(val);
+// f(m, a, b, c)
+void jit_call(ljit* j, void* f, int a, int b, int c) {
+	jit_emit(j, 3, 0x48, 0x89, 0xdf);          // mov rdi, rbx
+	jit_byte(j, 0xbe); jit_imm32(j, a);        // mov esi, a
+	jit_byte(j, 0xba); jit_imm32(j, b);        // mov edx, b
+	jit_byte(j, 0xb9); jit_imm32(j, c);        // mov ecx, c
+	jit_emit(j, 2, 0x48, 0xb8); jit_imm64(j, (uint64_t) f); // mov rax, f
+	jit_emit(j, 2, 0xff, 0xd0);                // call rax
+}
 
-				if (strcmp(func, "def") == 0) {
-					lenv_def(e, syms->cell[i], a->cell[i+1]);
-				}
+// Drops a reference to the lval in r12, r13 or r14 (reg 4-6)
+void jit_release(ljit* j, int reg) {
+#ifndef LISPR_GC
+	int ref = offsetof(lval, ref);
+	// mov eax, [reg+ref]
+	if (reg == 4) jit_emit(j, 5, 0x41, 0x8b, 0x44, 0x24, ref);
+	else jit_emit(j, 4, 0x41, 0x8b, 0x40 | reg, ref);
+	jit_byte(j, 0x3d); jit_imm32(j, LVAL_STATIC); // cmp eax, LVAL_STATIC
+	int is_static = jit_jump(j, 0x84);            // je
+	jit_emit(j, 3, 0x83, 0xe8, 0x01);             // sub eax, 1
+	// mov [reg+ref], eax
+	if (reg == 4) jit_emit(j, 5, 0x41, 0x89, 0x44, 0x24, ref);
+	else jit_emit(j, 4, 0x41, 0x89, 0x40 | reg, ref);
+	int shared = jit_jump(j, 0x85);               // jnz
+	jit_emit(j, 3, 0x4c, 0x89, 0xc7 | (reg << 3));   // mov rdi, reg
+	jit_emit(j, 2, 0x48, 0xb8); jit_imm64(j, (uint64_t) vm_free);  // mov rax, vm_free
+	jit_emit(j, 2, 0xff, 0xd0);                   // call rax
+	jit_land(j, is_static);
+	jit_land(j, shared);
+#endif
+}
 
-				if (strcmp(func, "=") == 0) {
-					lenv_put(e, syms->cell[i], a->cell[i+1]);
-				}
-    }
-    
-    lval_del(a);
-    return lval_sexpr();
+// The operator vm_binop would use for a call of the builtin named sym, if
+// it is one the inline path handles
+char jit_binop(char* sym, lbuiltin* f) {
+	static char* names[] = {"+", "-", "*", ">", "<", ">=", "<=", "==", "!="};
+	static char ops[] = "+-*><gl=!";
+	static lbuiltin fs[] = {builtin_add, builtin_sub, builtin_mul,
+		builtin_greater_than, builtin_smaller_than,
+		builtin_greater_than_or_equal_to, builtin_smaller_than_or_equal_to,
+		builtin_eq, builtin_ne};
+	for (int i = 0; i < 9; i++) {
+		if (lval_intern(names[i]) == sym) {
+			*f = fs[i];
+			return ops[i];
+		}
+	}
+	return 0;
 }
 
-lval* lval_call(lenv* e, lval* f, lval* a) {
-	if (f->builtin) return f->builtin(e,a);
+// setcc for the comparison op, after cmp (signed) or ucomisd (unsigned)
+int jit_setcc(char op, int is_double) {
+	switch (op) {
+		case '>': return is_double ? 0x97 : 0x9f;
+		case '<': return is_double ? 0x92 : 0x9c;
+		case 'g': return is_double ? 0x93 : 0x9d;
+		case 'l': return is_double ? 0x96 : 0x9e;
+		case '=': return 0x94;
+		default: return 0x95;
+	}
+}
 
-	// Record argument counts
-	int given = a->count;
-	int total = f->formals->count;
+#ifndef LISPR_NANBOX
+// Results of inline arithmetic that need allocating
+lval* jit_box_long(long l) {
+	Num n;
+	n.type = LONG;
+	n.l = l;
+	return lval_num(n);
+}
 
-	while (a->count) {
-		if (f->formals->count == 0) {
-			lval_del(a); 
-			return lval_err("Function passed too many arguments. Got %i, expected "
-					"%i", given, total);
-		}
+lval* jit_box_double(double d) {
+	Num n;
+	n.type = DOUBLE;
+	n.d = d;
+	return lval_num(n);
+}
 
-		// Pop first symbol from formals
-		lval* sym = lval_pop(f->formals,0);
+// call f, with its argument in rax (or xmm0) and the result left in rax
+void jit_box(ljit* j, void* f) {
+	jit_emit(j, 3, 0x48, 0x89, 0xc7);              // mov rdi, rax
+	jit_emit(j, 2, 0x48, 0xb8); jit_imm64(j, (uint64_t) f); // mov rax, f
+	jit_emit(j, 2, 0xff, 0xd0);                    // call rax
+}
+#endif
 
-		// Adding way to deal with variable number of arguments
-		if (strcmp(sym->sym, "&") == 0) {
-			// Ensure "&" is followed by another symbol
-			if (f->formals->count != 1) {
-				lval_del(a);
-				return lval_err("Function format invalid. Symbol '&' not followed by "
-						"single symbol");
-			}
+// rdx = &stack[sp-3], where an inline call's function is
+void jit_stack_top(ljit* j) {
+	jit_emit(j, 3, 0x8b, 0x4b, (int) offsetof(lvm, sp));     // mov ecx, [rbx+sp]
+	jit_emit(j, 4, 0x48, 0x8b, 0x53, (int) offsetof(lvm, stack)); // mov rdx, [rbx+stack]
+	jit_emit(j, 5, 0x48, 0x8d, 0x54, 0xca, 0xe8);  // lea rdx, [rdx+rcx*8-24]
+}
 
-			// Bind next formal to remaining arguments
-			lval* nsym = lval_pop(f->formals,0);
-			lenv_put(f->env, nsym, builtin_list(e,a));
-			lval_del(sym); lval_del(nsym);
-			break;
+// Inline path for a call of two arguments to builtin f (operator op).
+// Jumps that leave it for the generic call are added to slow.
+void jit_binop_inline(ljit* j, lbuiltin f, char op, int* slow, int* nslow) {
+	int arith = op == '+' || op == '-' || op == '*';
+
+	// r12, r13, r14 = function and arguments
+	jit_stack_top(j);
+	jit_emit(j, 3, 0x4c, 0x8b, 0x22);              // mov r12, [rdx]
+	jit_emit(j, 4, 0x4c, 0x8b, 0x6a, 0x08);        // mov r13, [rdx+8]
+	jit_emit(j, 4, 0x4c, 0x8b, 0x72, 0x10);        // mov r14, [rdx+16]
+
+	// The function must be f
+#ifdef LISPR_NANBOX
+	jit_emit(j, 3, 0x4c, 0x89, 0xe0);              // mov rax, r12
+	jit_emit(j, 4, 0x48, 0xc1, 0xe8, 0x30);        // shr rax, 48
+	slow[(*nslow)++] = jit_jump(j, 0x85);          // jnz
+	jit_emit(j, 4, 0x49, 0x83, 0xfc, (int) NB_TRUE); // cmp r12, NB_TRUE
+	slow[(*nslow)++] = jit_jump(j, 0x86);          // jbe
+#endif
+	jit_emit(j, 6, 0x41, 0x83, 0x7c, 0x24, (int) offsetof(lval, type), LVAL_FUN);
+	slow[(*nslow)++] = jit_jump(j, 0x85);
+	jit_emit(j, 2, 0x48, 0xb8); jit_imm64(j, (uint64_t) f); // mov rax, f
+	jit_emit(j, 5, 0x49, 0x39, 0x44, 0x24, (int) offsetof(lval, builtin));
+	slow[(*nslow)++] = jit_jump(j, 0x85);
+
+	int not_long, done;
+#ifdef LISPR_NANBOX
+	// Two integers: compute on the payloads shifted to the top, where
+	// overflow of 48 bits is overflow of 64
+	jit_emit(j, 3, 0x4c, 0x89, 0xe8);              // mov rax, r13
+	jit_emit(j, 4, 0x48, 0xc1, 0xe8, 0x30);        // shr rax, 48
+	jit_byte(j, 0x3d); jit_imm32(j, 0xffff);       // cmp eax, 0xffff
+	not_long = jit_jump(j, 0x85);
+	jit_emit(j, 3, 0x4c, 0x89, 0xf0);              // mov rax, r14
+	jit_emit(j, 4, 0x48, 0xc1, 0xe8, 0x30);        // shr rax, 48
+	jit_byte(j, 0x3d); jit_imm32(j, 0xffff);
+	slow[(*nslow)++] = jit_jump(j, 0x85);
+	jit_emit(j, 3, 0x4c, 0x89, 0xe8);              // mov rax, r13
+	jit_emit(j, 4, 0x48, 0xc1, 0xe0, 0x10);        // shl rax, 16
+	jit_emit(j, 3, 0x4c, 0x89, 0xf1);              // mov rcx, r14
+	jit_emit(j, 4, 0x48, 0xc1, 0xe1, 0x10);        // shl rcx, 16
+#else
+	// Two LONGs
+	jit_emit(j, 5, 0x41, 0x83, 0x7d, (int) offsetof(lval, type), LVAL_NUM);
+	slow[(*nslow)++] = jit_jump(j, 0x85);
+	jit_emit(j, 5, 0x41, 0x83, 0x7e, (int) offsetof(lval, type), LVAL_NUM);
+	slow[(*nslow)++] = jit_jump(j, 0x85);
+	jit_emit(j, 5, 0x41, 0x83, 0x7d, (int) offsetof(lval, num.type), LONG);
+	not_long = jit_jump(j, 0x85);
+	jit_emit(j, 5, 0x41, 0x83, 0x7e, (int) offsetof(lval, num.type), LONG);
+	slow[(*nslow)++] = jit_jump(j, 0x85);
+	jit_emit(j, 4, 0x49, 0x8b, 0x45, (int) offsetof(lval, num.l)); // mov rax, [r13+l]
+	jit_emit(j, 4, 0x49, 0x8b, 0x4e, (int) offsetof(lval, num.l)); // mov rcx, [r14+l]
+#endif
+	if (arith) {
+		if (op == '+') jit_emit(j, 3, 0x48, 0x01, 0xc8);      // add rax, rcx
+		if (op == '-') jit_emit(j, 3, 0x48, 0x29, 0xc8);      // sub rax, rcx
+		if (op == '*') {
+#ifdef LISPR_NANBOX
+			jit_emit(j, 4, 0x48, 0xc1, 0xf9, 0x10);             // sar rcx, 16
+#endif
+			jit_emit(j, 4, 0x48, 0x0f, 0xaf, 0xc1);             // imul rax, rcx
 		}
-		// Pop next argument from the list
-		lval* val = lval_pop(a,0);
-		// Bind copy into function's environment
-		lenv_put(f->env, sym, val);
-		// Delete symbol and value
-		lval_del(sym); lval_del(val);
+		slow[(*nslow)++] = jit_jump(j, 0x80);                 // jo
+#ifdef LISPR_NANBOX
+		jit_emit(j, 4, 0x48, 0xc1, 0xf8, 0x10);               // sar rax, 16
+		jit_emit(j, 2, 0x48, 0xb9); jit_imm64(j, NB_PAYLOAD); // mov rcx, NB_PAYLOAD
+		jit_emit(j, 3, 0x48, 0x21, 0xc8);                     // and rax, rcx
+		jit_emit(j, 2, 0x48, 0xb9); jit_imm64(j, NB_INT);     // mov rcx, NB_INT
+		jit_emit(j, 3, 0x48, 0x09, 0xc8);                     // or rax, rcx
+#else
+		// Small results are preallocated, others are boxed by a call
+		Num n;
+		n.type = LONG;
+		n.l = SMALL_INT_MIN;
+		jit_emit(j, 3, 0x48, 0x89, 0xc1);                     // mov rcx, rax
+		jit_emit(j, 3, 0x48, 0x81, 0xe9); jit_imm32(j, SMALL_INT_MIN); // sub rcx, MIN
+		jit_emit(j, 3, 0x48, 0x81, 0xf9); jit_imm32(j, SMALL_INT_MAX - SMALL_INT_MIN);
+		int big = jit_jump(j, 0x87);                          // ja
+		jit_emit(j, 3, 0x48, 0x69, 0xc9); jit_imm32(j, sizeof(lval)); // imul rcx, rcx, size
+		jit_emit(j, 2, 0x48, 0xb8); jit_imm64(j, (uint64_t) lval_num(n)); // mov rax, ints
+		jit_emit(j, 3, 0x48, 0x01, 0xc8);                     // add rax, rcx
+		int small = jit_jump(j, -1);
+		jit_land(j, big);
+		jit_box(j, (void*) jit_box_long);
+		jit_stack_top(j);
+		jit_land(j, small);
+#endif
+	}
+	else {
+		jit_emit(j, 3, 0x48, 0x39, 0xc8);                     // cmp rax, rcx
+		jit_emit(j, 3, 0x0f, jit_setcc(op, FALSE), 0xc0);     // setcc al
 	}
+	done = jit_jump(j, -1);
 
-	lval_del(a);
-	// If '&' remains in formal list, bind to empty list
-	if (f->formals->count > 0 && strcmp(f->formals->cell[0]->sym, "&") == 0) {
-		// Check that '&' is passed with one other symbol
-		if (f->formals->count != 2) {
-			return lval_err("Function format invalid. Symbol '&' not followed by "
-					"single symbol.");
-		}
+	// Two DOUBLEs
+	jit_land(j, not_long);
+#ifdef LISPR_NANBOX
+	for (int reg = 5; reg <= 6; reg++) {
+		jit_emit(j, 3, 0x4c, 0x89, 0xc0 | (reg << 3));      // mov rax, reg
+		jit_emit(j, 4, 0x48, 0xc1, 0xe8, 0x30);             // shr rax, 48
+		jit_emit(j, 3, 0x83, 0xe8, 0x02);                   // sub eax, 2
+		jit_byte(j, 0x3d); jit_imm32(j, 0xfffa - 2);        // cmp eax, 0xfff8
+		slow[(*nslow)++] = jit_jump(j, 0x87);               // ja
+	}
+	jit_emit(j, 2, 0x48, 0xb9); jit_imm64(j, NB_DOUBLE_OFFSET); // mov rcx, offset
+	jit_emit(j, 3, 0x4c, 0x89, 0xe8);                     // mov rax, r13
+	jit_emit(j, 3, 0x48, 0x29, 0xc8);                     // sub rax, rcx
+	jit_emit(j, 5, 0x66, 0x48, 0x0f, 0x6e, 0xc0);         // movq xmm0, rax
+	jit_emit(j, 3, 0x4c, 0x89, 0xf0);                     // mov rax, r14
+	jit_emit(j, 3, 0x48, 0x29, 0xc8);                     // sub rax, rcx
+	jit_emit(j, 5, 0x66, 0x48, 0x0f, 0x6e, 0xc8);         // movq xmm1, rax
+#else
+	jit_emit(j, 5, 0x41, 0x83, 0x7d, (int) offsetof(lval, num.type), DOUBLE);
+	slow[(*nslow)++] = jit_jump(j, 0x85);
+	jit_emit(j, 5, 0x41, 0x83, 0x7e, (int) offsetof(lval, num.type), DOUBLE);
+	slow[(*nslow)++] = jit_jump(j, 0x85);
+	jit_emit(j, 6, 0xf2, 0x41, 0x0f, 0x10, 0x45, (int) offsetof(lval, num.d)); // movsd xmm0, [r13+d]
+	jit_emit(j, 6, 0xf2, 0x41, 0x0f, 0x10, 0x4e, (int) offsetof(lval, num.d)); // movsd xmm1, [r14+d]
+#endif
+	if (arith) {
+		if (op == '+') jit_emit(j, 4, 0xf2, 0x0f, 0x58, 0xc1); // addsd xmm0, xmm1
+		if (op == '-') jit_emit(j, 4, 0xf2, 0x0f, 0x5c, 0xc1); // subsd xmm0, xmm1
+		if (op == '*') jit_emit(j, 4, 0xf2, 0x0f, 0x59, 0xc1); // mulsd xmm0, xmm1
+#ifdef LISPR_NANBOX
+		// A NaN is left for word_from_num to make canonical
+		jit_emit(j, 4, 0x66, 0x0f, 0x2e, 0xc0);              // ucomisd xmm0, xmm0
+		slow[(*nslow)++] = jit_jump(j, 0x8a);                // jp
+		jit_emit(j, 5, 0x66, 0x48, 0x0f, 0x7e, 0xc0);        // movq rax, xmm0
+		jit_emit(j, 3, 0x48, 0x01, 0xc8);                    // add rax, rcx
+#else
+		jit_box(j, (void*) jit_box_double);
+		jit_stack_top(j);
+#endif
+	}
+	if (!arith) {
+		// NaNs are left to num_cmp and num_eq
+		jit_emit(j, 4, 0x66, 0x0f, 0x2e, 0xc1);              // ucomisd xmm0, xmm1
+		slow[(*nslow)++] = jit_jump(j, 0x8a);                // jp
+		jit_emit(j, 3, 0x0f, jit_setcc(op, TRUE), 0xc0);     // setcc al
+	}
+
+	// The result replaces the call. A comparison gives 0 or 1 in al.
+	jit_land(j, done);
+	if (!arith) {
+		jit_emit(j, 3, 0x0f, 0xb6, 0xc0);                    // movzx eax, al
+#ifdef LISPR_NANBOX
+		jit_emit(j, 3, 0x83, 0xc8, (int) NB_FALSE);          // or eax, NB_FALSE
+#else
+		jit_emit(j, 2, 0x69, 0xc0);                          // imul eax, eax, step
+		jit_imm32(j, (char*) lval_bool(TRUE) - (char*) lval_bool(FALSE));
+		jit_emit(j, 2, 0x48, 0xb9); jit_imm64(j, (uint64_t) lval_bool(FALSE));
+		jit_emit(j, 3, 0x48, 0x01, 0xc8);                    // add rax, rcx
+#endif
+	}
+	jit_emit(j, 3, 0x48, 0x89, 0x02);                      // mov [rdx], rax
+	jit_emit(j, 4, 0x83, 0x6b, (int) offsetof(lvm, sp), 2); // sub dword [rbx+sp], 2
+	jit_release(j, 4);
+#ifndef LISPR_NANBOX
+	jit_release(j, 5);
+	jit_release(j, 6);
+#endif
+}
 
-		// Pop and delete '&' symbol
-		lval_del(lval_pop(f->formals,0));
+void jit_compile(lcode* code) {
+	ljit j;
+	j.size = 256;
+	j.len = 0;
+	j.buf = malloc(j.size);
+	j.native = malloc(sizeof(int) * code->count);
+	j.fixups = NULL;
+	j.nfixups = 0;
+	j.epilogue = -1;
 
-		// Pop next symbol and create empty list
-		lval* sym = lval_pop(f->formals,0);
-		lval* val = lval_qexpr();
+	// push rbx; push r12; push r13; push r14; sub rsp, 8; mov rbx, rdi
+	jit_emit(&j, 7, 0x53, 0x41, 0x54, 0x41, 0x55, 0x41, 0x56);
+	jit_emit(&j, 4, 0x48, 0x83, 0xec, 0x08);
+	jit_emit(&j, 3, 0x48, 0x89, 0xfb);
+
+	int pc = 0;
+	while (pc < code->count) {
+		int* op = code->ops + pc;
+		j.native[pc] = j.len;
+		switch (op[0]) {
+			case OP_CONST:
+				jit_call(&j, (void*) vm_const, op[1], 0, 0);
+				pc += 2;
+			break;
+			case OP_LOOKUP:
+			case OP_LOCAL:
+				jit_call(&j, op[0] == OP_LOOKUP ? (void*) vm_lookup : (void*) vm_local,
+						op[1], op[2], 0);
+				jit_emit(&j, 2, 0x85, 0xc0);         // test eax, eax
+				jit_jump_end(&j, 0x88);              // js
+				pc += 3;
+			break;
+			case OP_CALL:
+			case OP_TAILCALL: {
+				lbuiltin f;
+				char binop = op[1] == 2 && op[2] >= 0 ?
+					jit_binop(code->consts[op[2]]->sym, &f) : 0;
+				int slow[32];
+				int nslow = 0;
+				int next = -1;
+				if (binop) {
+					jit_binop_inline(&j, f, binop, slow, &nslow);
+					if (op[0] == OP_TAILCALL) {
+						jit_call(&j, (void*) vm_return, 0, 0, 0);
+						jit_jump_end(&j, -1);
+					}
+					else {
+						next = jit_jump(&j, -1);
+					}
+					for (int i = 0; i < nslow; i++) jit_land(&j, slow[i]);
+				}
+				if (op[0] == OP_TAILCALL) {
+					jit_call(&j, (void*) vm_tailcall, op[1], 0, 0);
+					jit_jump_end(&j, -1);
+				}
+				else {
+					jit_call(&j, (void*) vm_call, op[1], 0, 0);
+					jit_emit(&j, 2, 0x85, 0xc0);
+					jit_jump_end(&j, 0x88);
+				}
+				if (next >= 0) jit_land(&j, next);
+				pc += 3;
+			}
+			break;
+			case OP_REEVAL:
+				jit_call(&j, (void*) vm_reeval, 0, 0, 0);
+				jit_emit(&j, 2, 0x85, 0xc0);
+				jit_jump_end(&j, 0x88);
+				pc += 1;
+			break;
+			case OP_IF:
+				jit_call(&j, (void*) vm_if, op[1], op[2], 0);
+				jit_emit(&j, 2, 0x85, 0xc0);
+				jit_jump_end(&j, 0x88);
+				jit_emit(&j, 3, 0x83, 0xf8, 0x01);     // cmp eax, 1
+				jit_jump_pc(&j, 0x84, op[3]);          // je
+				jit_emit(&j, 3, 0x83, 0xf8, 0x02);     // cmp eax, 2
+				jit_jump_pc(&j, 0x84, op[4]);
+				pc += 5;
+			break;
+			case OP_JUNCTION:
+				jit_call(&j, (void*) vm_junction, op[1], op[2], op[3]);
+				jit_emit(&j, 2, 0x85, 0xc0);
+				jit_jump_end(&j, 0x88);
+				jit_emit(&j, 3, 0x83, 0xf8, 0x01);
+				jit_jump_pc(&j, 0x84, op[4]);
+				pc += 5;
+			break;
+			case OP_JUMP:
+				jit_jump_pc(&j, -1, op[1]);
+				pc += 2;
+			break;
+			case OP_RETURN:
+				jit_call(&j, (void*) vm_return, 0, 0, 0);
+				jit_jump_end(&j, -1);
+				pc += 1;
+			break;
+		}
+	}
 
-		// Bind to environment and delete
-		lenv_put(f->env, sym, val);
-		lval_del(sym); lval_del(val);
+	// Jumps to the end all go to the epilogue, which returns eax
+	while (j.epilogue >= 0) {
+		int next;
+		memcpy(&next, j.buf + j.epilogue, 4);
+		jit_land(&j, j.epilogue);
+		j.epilogue = next;
 	}
-	// If all formals have been bound, evaluate function
-	else if (f->formals->count == 0) {
-		f->env->par = e;
-		return builtin_eval(f->env, lval_add(lval_sexpr(), lval_copy(f->body)));
+	// add rsp, 8; pop r14; pop r13; pop r12; pop rbx; ret
+	jit_emit(&j, 4, 0x48, 0x83, 0xc4, 0x08);
+	jit_emit(&j, 8, 0x41, 0x5e, 0x41, 0x5d, 0x41, 0x5c, 0x5b, 0xc3);
+	for (int i = 0; i < j.nfixups; i++) {
+		jit_land_at(&j, j.fixups[2*i], j.native[j.fixups[2*i+1]]);
+	}
+
+	// Written, then made executable and no longer writable
+	void* mem = mmap(NULL, j.len, PROT_READ | PROT_WRITE,
+			MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (mem != MAP_FAILED) {
+		memcpy(mem, j.buf, j.len);
+		if (mprotect(mem, j.len, PROT_READ | PROT_EXEC) == 0) {
+			code->jit = mem;
+			code->jit_size = j.len;
+			jit_compiled++;
+			jit_bytes += j.len;
+		}
+		else {
+			munmap(mem, j.len);
+		}
 	}
-	return lval_copy(f);
+	free(j.buf);
+	free(j.native);
+	free(j.fixups);
+}
+
+void jit_free(lcode* code) {
+	if (code->jit) munmap(code->jit, code->jit_size);
 }
+#else
+// Machine code is only made for x86-64 Linux; elsewhere everything runs on
+// the interpreter
+void jit_compile(lcode* code) {}
+
+void jit_free(lcode* code) {}
+#endif
 
 char* ltype_name(int t) {
 	switch (t) {
@@ -953,24 +4263,42 @@ char* ltype_name(int t) {
 		case LVAL_STR: return "string";
 		case LVAL_SEXPR: return "s-expression";
 		case LVAL_QEXPR: return "q-expression";
+		case LVAL_VEC: return "vector";
 		default: return "unknown";
 	}
 }
 
-lval* lval_lambda(lval* formals, lval* body) {
-	lval* v = malloc(sizeof(lval));
+lval* lval_lambda(lenv* e, lval* formals, lval* body) {
+	lval* v = lval_alloc();
 	v->type = LVAL_FUN;
+	v->ref = 1;
 
 	// Set builtin to NULL; this allows us to distinguish between builtin and user-defined
 	// functions
 	v->builtin = NULL;
 
-	// Build new environment
-	v->env = lenv_new();
-
 	// Set formals and body
 	v->formals = formals;
 	v->body = body;
+
+	// Nothing is bound yet; compile the body. Calls bind the formals in a
+	// frame, so they can no longer be assumed to be bound only globally;
+	// that settles what the body may fold. The body is kept as written,
+	// and the code compiled from the folded copy.
+	v->env = NULL;
+	v->bound = 0;
+	v->code = NULL;
+	for (int i = 0; i < formals->count; i++) lenv_shadow(formals->cell[i]->sym);
+	lval_fold_nsyms = 0;
+	lval* folded = lval_fold_enabled ? lval_fold_code(e, lval_ref(body)) : lval_ref(body);
+	v->code = lcode_compile(formals, folded);
+	lval_del(folded);
+	if (lval_fold_nsyms) {
+		v->code->nfolded = lval_fold_nsyms;
+		v->code->folded = malloc(sizeof(char*) * lval_fold_nsyms);
+		memcpy(v->code->folded, lval_fold_syms, sizeof(char*) * lval_fold_nsyms);
+		v->code->fold_version = lenv_version;
+	}
 	return v;
 }
 
@@ -992,75 +4320,53 @@ lval* builtin_lambda(lenv* e, lval* a) {
 	lval* body = lval_pop(a,0);
 	lval_del(a);
 
-	return lval_lambda(formals, body);
+	return lval_lambda(e, formals, body);
 }
 
-lval* lval_equals(lval* x, lval* y) {
+// Structural equality. Only booleans come out of a comparison, and they
+// are static, so comparing never allocates.
+int lval_eq(lval* x, lval* y) {
 	// If the inputs have different type, they can't be equal
-	if (x->type != y->type) {
-		return lval_bool(FALSE);
-	}
+	if (x->type != y->type) return 0;
 
-	lval* res;
 	switch (x->type) {
-		case LVAL_NUM:
-			// Simple numerical comparison
-			res = numerical_equals(x->num, y->num);
-		break;
-		case LVAL_SYM:
-			res = strcmp(x->sym,y->sym) == 0 ? lval_bool(TRUE) : lval_bool(FALSE);
-		break;
-		case LVAL_STR:
-			res = strcmp(x->str, y->str) == 0 ? lval_bool(TRUE) : lval_bool(FALSE);
-		break;
+		case LVAL_NUM: return num_eq(x->num, y->num);
+		case LVAL_SYM: return x->sym == y->sym;
+		case LVAL_STR: return strcmp(x->str, y->str) == 0;
+		case LVAL_ERR: return strcmp(x->err, y->err) == 0;
+		case LVAL_BOOL: return x->bool == y->bool;
 		case LVAL_FUN:
-			if (x->builtin || y->builtin) {
-				res = x->builtin == y->builtin ? lval_bool(TRUE) :
-					lval_bool(FALSE);
-			}
-			else {
-				if (lval_equals(x->formals,y->formals) &&
-						lval_equals(x->body,y->body)) {
-					res = lval_bool(TRUE);
-				}
-				else res = lval_bool(FALSE);
-			}
-		break;
-		case LVAL_ERR:
-			res = strcmp(x->err,y->err) == 0 ? lval_bool(TRUE) :
-				lval_bool(FALSE);
-		break;
+			if (x->builtin || y->builtin) return x->builtin == y->builtin;
+			return x->bound == y->bound && lval_eq(x->formals, y->formals) &&
+				lval_eq(x->body, y->body);
 		case LVAL_SEXPR:
 		case LVAL_QEXPR:
-			if (x->count != y->count) return lval_bool(FALSE);
+			if (x->count != y->count) return 0;
 			for (int i = 0; i < x->count; i++) {
-				if (lval_equals(x->cell[i], y->cell[i])->bool == FALSE) {
-					lval_del(x); lval_del(y);
-					return lval_bool(FALSE);
+				if (!lval_eq(x->cell[i], y->cell[i])) return 0;
+			}
+			return 1;
+		case LVAL_VEC:
+			// Equal if the elements are, as numbers
+			if (x->len != y->len) return 0;
+			for (int i = 0; i < x->len; i++) {
+				double a = x->vtype == LONG ? x->vl[i] : x->vd[i];
+				double b = y->vtype == LONG ? y->vl[i] : y->vd[i];
+				if (x->vtype == LONG && y->vtype == LONG ? x->vl[i] != y->vl[i] : a != b) {
+					return 0;
 				}
 			}
-			res = lval_bool(TRUE);
-		break;
+			return 1;
 	}
-
-	return res;
+	return 0;
 }
 
 lval* builtin_cmp(lenv* e, lval* a, char* op) {
 	CHECK_COUNT(op, a, 2);
 
-	lval* res;
-	if (strcmp(op, "==") == 0) {
-		res = lval_equals(a->cell[0],a->cell[1]);
-	}
-	else {
-		// Opposite result
-		lval* opp = lval_equals(a->cell[0],a->cell[1]);
-		res = opp->bool == TRUE ? lval_bool(FALSE) : lval_bool(TRUE);
-		lval_del(opp);
-	}
+	int eq = lval_eq(a->cell[0], a->cell[1]);
 	lval_del(a);
-	return res;
+	return lval_bool(strcmp(op, "==") == 0 ? eq : !eq);
 }
 
 lval* builtin_eq(lenv* e, lval* a) {
@@ -1070,180 +4376,63 @@ lval* builtin_eq(lenv* e, lval* a) {
 lval* builtin_ne(lenv* e, lval* a) {
 	return builtin_cmp(e,a,"!=");
 }
-			
-lval* numerical_equals(Num x, Num y) {
-	int result;
-	switch (x.type) {
-		case LONG:
-			switch (y.type) {
-				case LONG:
-					if (x.l == y.l) {
-						result = TRUE;
-						break;
-					}
-					result = FALSE;
-				break;
-				case DOUBLE:
-					if (x.l == y.d) {
-						result = TRUE;
-						break;
-					}
-					result = FALSE;
-				break;
-			}
-		break;
-		case DOUBLE:
-			switch (y.type) {
-				case LONG:
-					if (x.d == y.l) {
-						result = TRUE;
-						break;
-					}
-					result = FALSE;
-				break;
-				case DOUBLE:
-					if (x.d == y.d) {
-						result = TRUE;
-						break;
-					}
-					result = FALSE;
-				break;
-			}
-		break;
-	}
 
-	return lval_bool(result);
+// Numbers are equal if their values are, whatever their types. A NaN
+// equals nothing, as in C.
+int num_eq(Num x, Num y) {
+	if (x.type == LONG && y.type == LONG) return x.l == y.l;
+	if (x.type == BIG || y.type == BIG) return num_cmp(x, y) == 0;
+	return num_to_double(x) == num_to_double(y);
 }
 
-lval* builtin_greater_than(lenv* e, lval* a) {
-	CHECK_COUNT(">", a, 2);
-	CHECK_INPUT_TYPE(">", a, 0, LVAL_NUM);
-	CHECK_INPUT_TYPE(">", a, 1, LVAL_NUM);
-	
-	Num x = a->cell[0]->num;
-	Num y = a->cell[1]->num;
-	int result;
-
-	switch (x.type) {
-		case LONG:
-			switch (y.type) {
-				case LONG:
-					if (x.l > y.l) {
-						result = TRUE;
-						break;
-					}
-					result = FALSE;
-				break;
-				case DOUBLE:
-					if (x.l > y.d) {
-						result = TRUE;
-						break;
-					}
-					result = FALSE;
-				break;
-			}
-		break;
-		case DOUBLE:
-			switch (y.type) {
-				case LONG:
-					if (x.d > y.l) {
-						result = TRUE;
-						break;
-					}
-					result = FALSE;
-				break;
-				case DOUBLE:
-					if (x.d > y.d) {
-						result = TRUE;
-						break;
-					}
-					result = FALSE;
-				break;
-			}
-		break;
-	}
+// Ordering of two numbers. Comparisons with a NaN count as equal, so only
+// <= and >= hold for them.
+lval* builtin_ord(lenv* e, lval* a, char* op) {
+	CHECK_COUNT(op, a, 2);
+	CHECK_INPUT_TYPE(op, a, 0, LVAL_NUM);
+	CHECK_INPUT_TYPE(op, a, 1, LVAL_NUM);
 
+	int c = num_cmp(a->cell[0]->num, a->cell[1]->num);
 	lval_del(a);
-	return result == TRUE ? lval_bool(TRUE) : lval_bool(FALSE);
+	switch (op[0]) {
+		case '>': return lval_bool(op[1] ? c >= 0 : c > 0);
+		default: return lval_bool(op[1] ? c <= 0 : c < 0);
+	}
 }
 
-lval* builtin_smaller_than(lenv* e, lval* a) {
-	CHECK_COUNT("<", a, 2);
-	CHECK_INPUT_TYPE("<", a, 0, LVAL_NUM);
-	CHECK_INPUT_TYPE("<", a, 1, LVAL_NUM);
-
-	// Result of opposite operation
-	Num x = a->cell[0]->num;
-	Num y = a->cell[1]->num;
-	int result;
-	switch (x.type) {
-		case LONG:
-			switch (y.type) {
-				case LONG:
-					if (x.l < y.l) {
-						result = TRUE;
-						break;
-					}
-					result = FALSE;
-				break;
-				case DOUBLE:
-					if (x.l < y.d) {
-						result = TRUE;
-						break;
-					}
-					result = FALSE;
-				break;
-			}
-		break;
-		case DOUBLE:
-			switch (y.type) {
-				case LONG:
-					if (x.d < y.l) {
-						result = TRUE;
-						break;
-					}
-					result = FALSE;
-				break;
-				case DOUBLE:
-					if (x.d < y.d) {
-						result = TRUE;
-						break;
-					}
-					result = FALSE;
-				break;
-			}
-		break;
-	}
+lval* builtin_greater_than(lenv* e, lval* a) {
+	return builtin_ord(e, a, ">");
+}
 
-	lval_del(a);
-	return result == TRUE ? lval_bool(TRUE) : lval_bool(FALSE);
+lval* builtin_smaller_than(lenv* e, lval* a) {
+	return builtin_ord(e, a, "<");
 }
 
 lval* builtin_smaller_than_or_equal_to(lenv* e, lval* a) {
-	CHECK_COUNT("<=", a, 2);
-	CHECK_INPUT_TYPE("<=", a, 0, LVAL_NUM);
-	CHECK_INPUT_TYPE("<=", a, 0, LVAL_NUM);
-
-	lval* opp = builtin_greater_than(e, a);
-	int result = opp->bool == TRUE ? FALSE : TRUE;
-	// a gets deallocated in builtin_greater_than
-	lval_del(opp);
-	return result == TRUE ? lval_bool(TRUE) : lval_bool(FALSE);
+	return builtin_ord(e, a, "<=");
 }
 
 lval* builtin_greater_than_or_equal_to(lenv* e, lval* a) {
-	CHECK_COUNT(">=", a, 2);
-	CHECK_INPUT_TYPE(">=", a, 0, LVAL_NUM);
-	CHECK_INPUT_TYPE(">=", a, 0, LVAL_NUM);
-
-	lval* opp = builtin_smaller_than(e, a);
-	int result = opp->bool == TRUE ? FALSE : TRUE;
-	// a gets deallocated in builtin_smaller_than
-	lval_del(opp);
-	return result == TRUE ? lval_bool(TRUE) : lval_bool(FALSE);
+	return builtin_ord(e, a, ">=");
 }
 
 lval* builtin_if(lenv* e, lval* a) {
+	return lval_eval(e, lval_if_branch(a));
+}
+
+// v is a call of the builtin if with literal q-expressions for branches
+int lval_is_if(lenv* e, lval* v) {
+	if (v->count != 4 || v->cell[0]->type != LVAL_SYM || v->cell[0]->sym != sym_if ||
+			v->cell[2]->type != LVAL_QEXPR || v->cell[3]->type != LVAL_QEXPR) {
+		return FALSE;
+	}
+	lval* f = lenv_get(e, v->cell[0]);
+	int is_if = f->type == LVAL_FUN && f->builtin == builtin_if;
+	lval_del(f);
+	return is_if;
+}
+
+lval* lval_if_branch(lval* a) {
 	// an if should have three parts: a condition, code to be evaluated
 	// if the condition is true, and code to be evaluated if the condition
 	// is false
@@ -1253,17 +4442,46 @@ lval* builtin_if(lenv* e, lval* a) {
 	CHECK_INPUT_TYPE("if", a, 1, LVAL_QEXPR);
 	CHECK_INPUT_TYPE("if", a, 2, LVAL_QEXPR);
 
-	lval* result;
-	// make both q-expressions be s-expressions so they can be evaluated
-	a->cell[1]->type = LVAL_SEXPR;
-	a->cell[2]->type = LVAL_SEXPR;
-	if (a->cell[0]->bool == TRUE) {
-		result = lval_eval(e, lval_pop(a,1));
-	}
-	else {
-		result = lval_eval(e, lval_pop(a,2));
+	// make the chosen q-expression an s-expression so it can be evaluated
+	lval* branch = lval_own(lval_pop(a, a->cell[0]->bool == TRUE ? 1 : 2));
+	branch->type = LVAL_SEXPR;
+	lval_del(a);
+	return branch;
+}
+
+// && and || are special forms wherever they are called by name with two
+// or more operands: the operands are evaluated in order only until one
+// decides the result. Results and type errors are those of the builtins,
+// which still serve calls made any other way (through map, say).
+int lval_is_junction(lval* f) {
+	return f->type == LVAL_FUN &&
+		(f->builtin == builtin_and || f->builtin == builtin_or);
+}
+
+lval* lval_junction_err(lbuiltin f, int i, int type) {
+	return lval_err("Function '%s' passed wrong argument type. Expected "
+			"argument %d to be %s, received %s.", f == builtin_or ? "||" : "&&", i,
+			ltype_name(LVAL_BOOL), ltype_name(type));
+}
+
+// Evaluates the operands of v, whose first cell is && or || evaluated
+lval* lval_junction(lenv* e, lval* v) {
+	lbuiltin f = v->cell[0]->builtin;
+	int stop = f == builtin_or;
+	lval* x = NULL;
+	for (int i = 1; !x; i++) {
+		v->cell[i] = lval_eval(e, v->cell[i]);
+		lval* y = v->cell[i];
+		if (y->type == LVAL_ERR) return lval_take(v, i);
+		if (y->type != LVAL_BOOL) {
+			x = lval_junction_err(f, i-1, y->type);
+		}
+		else if (y->bool == stop || i == v->count-1) {
+			x = lval_bool(y->bool);
+		}
 	}
-	return result;
+	lval_del(v);
+	return x;
 }
 
 lval* builtin_and(lenv* e, lval* a) {
@@ -1352,19 +4570,40 @@ lval* builtin_error(lenv* e, lval* a) {
 }
 
 lenv* lenv_copy(lenv* e) {
-	lenv* n = malloc(sizeof(lenv));
+	lenv* n = lenv_alloc();
 	n->par = e->par;
 	n->count = e->count;
-	n->syms = malloc(sizeof(char*) * n->count);
-	n->vals = malloc(sizeof(lval*) * n->count);
+
+	// Match the power of two capacity lenv_put expects
+	int cap = 1;
+	while (cap < n->count) cap *= 2;
+	n->syms = malloc(sizeof(char*) * cap);
+	n->vals = malloc(sizeof(lval*) * cap);
 	for (int i = 0; i < e->count; i++) {
-		n->syms[i] = malloc(strlen(e->syms[i]) + 1);
-		strcpy(n->syms[i], e->syms[i]);
-		n->vals[i] = lval_copy(e->vals[i]);
+		n->syms[i] = e->syms[i];
+		n->vals[i] = lval_ref(e->vals[i]);
+	}
+
+	// Positions are unchanged, so the index can be copied as is
+	n->size = e->size;
+	n->index = NULL;
+	if (e->index) {
+		n->index = malloc(sizeof(int) * e->size);
+		memcpy(n->index, e->index, sizeof(int) * e->size);
 	}
 	return n;
 }
 
+void lenv_inherit(lenv* e, lenv* from) {
+	for (int i = 0; i < from->count; i++) {
+		if (lenv_find(e, from->syms[i]) < 0) {
+			lval k;
+			k.sym = from->syms[i];
+			lenv_put(e, &k, from->vals[i]);
+		}
+	}
+}
+
 void lenv_def(lenv* e, lval* k, lval* v) {
 	while (e->par) e = e->par;
 	lenv_put(e,k,v);
@@ -1393,6 +4632,31 @@ void lenv_add_builtins(lenv* e) {
     lenv_add_builtin(e, "cons", builtin_cons);
     lenv_add_builtin(e, "len", builtin_len);
     lenv_add_builtin(e, "init", builtin_init);
+#ifndef LISPR_LISP_LISTS
+    // Builds with LISPR_LISP_LISTS use stdlib's Lisp definitions instead
+    lenv_add_builtin(e, "map", builtin_map);
+    lenv_add_builtin(e, "filter", builtin_filter);
+    lenv_add_builtin(e, "foldl", builtin_foldl);
+    lenv_add_builtin(e, "nth", builtin_nth);
+    lenv_add_builtin(e, "last", builtin_last);
+    lenv_add_builtin(e, "elem", builtin_elem);
+    lenv_add_builtin(e, "take", builtin_take);
+    lenv_add_builtin(e, "drop", builtin_drop);
+    lenv_add_builtin(e, "split", builtin_split);
+#endif
+
+    // Vector functions
+    lenv_add_builtin(e, "vec", builtin_vec);
+    lenv_add_builtin(e, "vec-list", builtin_vec_list);
+    lenv_add_builtin(e, "vec+", builtin_vec_add);
+    lenv_add_builtin(e, "vec-", builtin_vec_sub);
+    lenv_add_builtin(e, "vec*", builtin_vec_mul);
+    lenv_add_builtin(e, "vec/", builtin_vec_div);
+    lenv_add_builtin(e, "vec-scale", builtin_vec_scale);
+    lenv_add_builtin(e, "dot", builtin_dot);
+    lenv_add_builtin(e, "vec-sum", builtin_vec_sum);
+    lenv_add_builtin(e, "vec-min", builtin_vec_min);
+    lenv_add_builtin(e, "vec-max", builtin_vec_max);
 
 		lenv_add_builtin(e, "==", builtin_eq);
 		lenv_add_builtin(e, "!=", builtin_ne);
@@ -1411,35 +4675,18 @@ void lenv_add_builtins(lenv* e) {
 		lenv_add_builtin(e, "load", builtin_load);
 		lenv_add_builtin(e, "print", builtin_print);
 		lenv_add_builtin(e, "error", builtin_error);
+		lenv_add_builtin(e, "alloc-stats", builtin_alloc_stats);
 }
 
 lval* builtin_load(lenv* e, lval* a) {
 	CHECK_COUNT("load", a, 1);
 	CHECK_INPUT_TYPE("load", a, 0, LVAL_STR);
 
-	// parse file
-	mpc_result_t r;
-	if (mpc_parse_contents(a->cell[0]->str, Lispr, &r)) {
-		// read contents
-		lval* expr = lval_read(r.output);
-		mpc_ast_delete(r.output);
-
-		// evaluate each expression
-		while (expr->count) {
-			lval* x = lval_eval(e, lval_pop(expr, 0));
-			if (x->type == LVAL_ERR) lval_println(e,x);
-			lval_del(x);
-		}
-
-		// delete expression and arguments
-		lval_del(expr); lval_del(a);
-
-		// return empty list to signal correct execution
-		return lval_sexpr();
-	}
-
-	else {
-		// get parse error as string
+	FILE* f = fopen(a->cell[0]->str, "rb");
+	if (!f) {
+		// Let mpc report what is wrong
+		mpc_result_t r;
+		mpc_parse_contents(a->cell[0]->str, Lispr, &r);
 		char* err_msg = mpc_err_string(r.error);
 		mpc_err_delete(r.error);
 		lval* err = lval_err("Could not load library %s", err_msg);
@@ -1447,4 +4694,24 @@ lval* builtin_load(lenv* e, lval* a) {
 		lval_del(a);
 		return err;
 	}
+
+	// Evaluate each form as soon as it is read. Forms before a syntax
+	// error have already run by the time it is reported.
+	lreader r;
+	lreader_init(&r, f);
+	lval* x;
+	int status;
+	while ((status = lreader_next(&r, a->cell[0]->str, &x)) > 0) {
+		if (lval_fold_enabled) x = lval_fold(e, x);
+		x = lval_eval(e, x);
+		if (x->type == LVAL_ERR) lval_println(e,x);
+		lval_del(x);
+	}
+	lreader_free(&r);
+	fclose(f);
+	lval_del(a);
+	if (status < 0) return x;
+
+	// return empty list to signal correct execution
+	return lval_sexpr();
 }
@@ -3,6 +3,15 @@
 #include "types.h"
 #include "mpc.h"
 #include "macros.h"
+#include <stdint.h>
+#include <limits.h>
+
+// Interned names the evaluator compares against by pointer
+extern char* sym_amp;
+extern char* sym_def;
+extern char* sym_if;
+extern char* sym_and;
+extern char* sym_or;
 
 // parser
 mpc_parser_t* Number;
@@ -20,33 +29,121 @@ mpc_parser_t* Lispr;
 lval* eval(mpc_ast_t*);
 lval* lval_read_num(mpc_ast_t*);
 lval* lval_read(mpc_ast_t*);
+void lval_read_space(char** p);
+int lval_is_symbol_char(char c);
+lval* lval_read_token(char* s, int len, int type);
+lval* lval_read_string(char** p);
+lval* lval_read_expr(char** p);
+lval* lval_read_src(char* s);
+// Bytes load reads from a file at a time
+#ifndef LREADER_CHUNK
+#define LREADER_CHUNK 65536
+#endif
+// Bytes of a mapped file read before their pages are unmapped
+#ifndef LREADER_UNMAP
+#define LREADER_UNMAP (4 * 1024 * 1024)
+#endif
+extern int lval_fold_enabled;
+extern long lval_folds;
+int lval_fold_pure(lbuiltin f);
+extern char** lval_fold_syms;
+extern int lval_fold_nsyms;
+void lval_fold_sym(char* sym);
+lbuiltin lval_fold_builtin(lenv* e, lval* sym);
+lval* lval_fold_set(lval* v, int i, lval* x);
+lval* lval_fold_code(lenv* e, lval* v);
+lval* lval_fold(lenv* e, lval* v);
+void lreader_init(lreader* r, FILE* f);
+void lreader_free(lreader* r);
+void lreader_fill(lreader* r);
+void lreader_skip(lreader* r, char* to);
+int lreader_next(lreader* r, char* name, lval** x);
+
+// Allocation
+// Allocations between collections when built with LISPR_GC
+#ifndef GC_MIN_THRESHOLD
+#define GC_MIN_THRESHOLD 100000
+#endif
+void lval_gc_init(void* stack_base);
+void lval_gc_collect(void);
+lval* lval_alloc(void);
+void lval_free(lval*);
+lenv* lenv_alloc(void);
+void lenv_free(lenv*);
 
 // lval creation
+// Owner count of statically allocated values
+#define LVAL_STATIC INT_MAX
+// Range of integers served from preallocated values
+#define SMALL_INT_MIN -128
+#define SMALL_INT_MAX 1023
+void lval_init_statics(void);
 lval* lval_num(Num);
 lval* lval_err(char*, ...);
 lval* lval_sym(char*);
+char* lval_intern(char*);
+unsigned intern_hash(char*);
 lval* lval_str(char* s);
 lval* lval_sexpr(void);
 lval* lval_qexpr(void);
 lval* lval_fun(lbuiltin);
-lval* lval_lambda(lval* formals, lval* body);
+lval* lval_lambda(lenv* e, lval* formals, lval* body);
 lval* lval_bool(int b);
+lval* lval_nil(void);
 
 // builtins
 lval* builtin_head(lenv*, lval*);
 lval* builtin_tail(lenv*, lval*);
 lval* builtin_list(lenv*, lval*);
 lval* builtin_eval(lenv*, lval*);
+lval* lval_eval_arg(lval*);
 lval* builtin_join(lenv*, lval*);
 lval* lval_join(lval*,lval*);
 lval* builtin_cons(lenv*, lval*);
 lval* builtin_len(lenv*, lval*);
 lval* builtin_init(lenv*, lval*);
+lval* builtin_map(lenv* e, lval* a);
+lval* builtin_filter(lenv* e, lval* a);
+lval* builtin_foldl(lenv* e, lval* a);
+lval* builtin_nth(lenv* e, lval* a);
+lval* builtin_last(lenv* e, lval* a);
+lval* builtin_elem(lenv* e, lval* a);
+lval* builtin_take(lenv* e, lval* a);
+lval* builtin_drop(lenv* e, lval* a);
+lval* builtin_split(lenv* e, lval* a);
+
+// Vectors
+lval* lval_vec(int vtype, int len);
+void vec_kernel_op(char op, double* out, double* x, double* y, int n);
+void vec_kernel_scale(double* out, double* x, double k, int n);
+double vec_kernel_dot(double* x, double* y, int n);
+double vec_kernel_minmax(double* x, int n, int max);
+Num vec_long_dot(long* x, long* y, int n);
+double* vec_doubles(lval* v);
+lval* builtin_vec(lenv* e, lval* a);
+lval* builtin_vec_list(lenv* e, lval* a);
+lval* builtin_vec_add(lenv* e, lval* a);
+lval* builtin_vec_sub(lenv* e, lval* a);
+lval* builtin_vec_mul(lenv* e, lval* a);
+lval* builtin_vec_div(lenv* e, lval* a);
+lval* builtin_vec_op(lenv* e, lval* a, char op);
+lval* builtin_vec_scale(lenv* e, lval* a);
+lval* builtin_dot(lenv* e, lval* a);
+lval* builtin_vec_sum(lenv* e, lval* a);
+lval* builtin_vec_min(lenv* e, lval* a);
+lval* builtin_vec_max(lenv* e, lval* a);
+lval* builtin_vec_minmax(lenv* e, lval* a, int max);
+lval* lval_fst(lenv* e, lval* x);
+lval* lval_index_check(lval* a, int i, int max, char* fun);
+lval* lval_take_n(lval* l, int n);
+lval* lval_drop_n(lval* l, int n);
 lval* builtin_add(lenv*, lval*);
 lval* builtin_sub(lenv*, lval*);
 lval* builtin_mul(lenv*, lval*);
 lval* builtin_div(lenv*, lval*);
 lval* builtin_mod(lenv*, lval*);
+lval* builtin_exp(lenv*, lval*);
+lval* builtin_op(lenv* e, lval* a, char op);
 lval* builtin_def(lenv*, lval*);
 lval* builtin_lambda(lenv*, lval*);
 lval* builtin_put(lenv* e, lval* a);
@@ -55,15 +152,27 @@ lval* builtin_eq(lenv* e, lval* a);
 lval* builtin_ne(lenv* e, lval* a);
 lval* builtin_greater_than(lenv* e, lval* a);
 lval* builtin_smaller_than(lenv* e, lval* a);
+lval* builtin_smaller_than_or_equal_to(lenv* e, lval* a);
+lval* builtin_greater_than_or_equal_to(lenv* e, lval* a);
+lval* builtin_ord(lenv* e, lval* a, char* op);
+lval* builtin_if(lenv* e, lval* a);
 lval* builtin_and(lenv* e, lval* a);
 lval* builtin_or(lenv* e, lval* a);
 lval* builtin_not(lenv* e, lval* a);
+int lval_is_junction(lval* f);
+lval* lval_junction_err(lbuiltin f, int i, int type);
+lval* lval_junction(lenv* e, lval* v);
 lval* builtin_load(lenv* e, lval* a);
 lval* builtin_print(lenv* e, lval* a);
 lval* builtin_error(lenv* e, lval* a);
+lval* builtin_alloc_stats(lenv* e, lval* a);
 
 // Utilities
 void lval_del(lval*);
+lval* lval_slice(lval* v, int from, int count);
+void lval_unshare(lval* v);
+void lval_reserve(lval* v, int n);
+void lval_reserve_front(lval* v, int n);
 lval* lval_add(lval*, lval*);
 void lval_expr_print(lenv* e, lval* v, char open, char close);
 void lval_print(lenv* e, lval* v);
@@ -74,23 +183,132 @@ lval* lval_eval(lenv*, lval*);
 lval* lval_pop(lval*, int);
 lval* lval_take(lval*, int);
 lval* lval_copy(lval*);
+lval* lval_ref(lval*);
+lval* lval_own(lval*);
 lenv* lenv_new(void);
 lenv* lenv_copy(lenv* e);
 char* ltype_name(int);
 int valid_math_input(lval*);
 void print_env(lenv* e);
 lval* lval_call(lenv* e, lval* f, lval* a);
-lval* lval_equals(lval* x, lval* y);
-lval* numerical_equals(Num x, Num y);
+lval* lval_apply(lenv* e, lval* f, lval* v);
+lval* lval_bind(lenv* e, lval* f, lval* a, lenv** frame);
+int lval_is_if(lenv* e, lval* v);
+lval* lval_if_branch(lval* a);
+int lval_eq(lval* x, lval* y);
+int num_eq(Num x, Num y);
 lval* builtin_cmp(lenv* e, lval* a, char* op);
 void lval_print_str(lval* v);
 lval* lval_read_str(mpc_ast_t* t);
 
+// Bytecode
+lcode* lcode_compile(lval* formals, lval* body);
+void lcode_del(lcode* code);
+lcode* lcode_current(lval* fn);
+lval* vm_args(lword* stack, int* sp, int n);
+int vm_binop(lbuiltin f, lword a, lword b, lword* r);
+int vm_const(lvm* m, int k);
+int vm_lookup(lvm* m, int k, int c);
+int vm_local(lvm* m, int k, int i);
+int vm_call_binop(lvm* m, int n);
+int vm_call(lvm* m, int n);
+int vm_tailcall(lvm* m, int n);
+int vm_reeval(lvm* m);
+int vm_if(lvm* m, int k_then, int k_else);
+int vm_junction(lvm* m, int stop, int i, int n);
+int vm_return(lvm* m);
+lval* vm_run(lenv* e, lcode* code, lval** tail_f, lval** tail_a);
+
+// Machine code. Bodies run this many times are compiled, unless
+// vm_jit_enabled is cleared (--no-jit)
+#ifndef JIT_THRESHOLD
+#define JIT_THRESHOLD 100
+#endif
+extern int vm_jit_enabled;
+extern long jit_compiled;
+extern long jit_bytes;
+void jit_compile(lcode* code);
+void jit_free(lcode* code);
+void vm_free(lval* v);
+
+// VM values. A NaN-boxed word is told apart by its top 16 bits:
+//   0x0000         an lval*, or one of the constants below
+//   0x0001         an interned symbol name
+//   0x0002-0xfffa  a double, stored as its bits plus 2^49
+//   0xffff         a 48-bit integer
+// Pointers are stored as they are, so the collector still finds them
+// when it scans the stack.
+#ifdef LISPR_NANBOX
+#define NB_NIL ((lword) 0x2)
+#define NB_FALSE ((lword) 0x6)
+#define NB_TRUE ((lword) 0x7)
+#define NB_SYM ((lword) 1 << 48)
+#define NB_DOUBLE_OFFSET ((lword) 1 << 49)
+#define NB_INT ((lword) 0xffff << 48)
+#define NB_PAYLOAD (((lword) 1 << 48) - 1)
+#define NB_INT_MIN (-(1L << 47))
+#define NB_INT_MAX ((1L << 47) - 1)
+#endif
+lword word_from_lval(lval* v);
+lval* word_to_lval(lword w);
+void word_del(lword w);
+int word_num(lword w, Num* n);
+lword word_from_num(Num n);
+int word_bool(lword w);
+lword word_from_bool(int b);
+lval* word_fun(lword w);
+
+// Bignums
+lbig* big_new(int count);
+void big_del(lbig* b);
+lbig* big_copy(lbig* b);
+lbig* big_from_long(long l);
+void big_trim(lbig* b);
+double big_to_double(lbig* b);
+int big_cmp_mag(lbig* a, lbig* b);
+int big_cmp(lbig* a, lbig* b);
+lbig* big_add_mag(lbig* a, lbig* b);
+lbig* big_sub_mag(lbig* a, lbig* b);
+lbig* big_add(lbig* a, lbig* b);
+lbig* big_sub(lbig* a, lbig* b);
+lbig* big_mul(lbig* a, lbig* b);
+unsigned big_divmod_small(lbig* a, unsigned v);
+void big_divmod_mag(unsigned* q, unsigned* r, unsigned* u, unsigned* v,
+		int m, int n);
+void big_divmod(lbig* a, lbig* b, lbig** q, lbig** r);
+lbig* big_from_str(char* s);
+void big_print(lbig* b);
+
+// Numbers
+Num num_from_big(lbig* b);
+Num num_copy(Num n);
+void num_clear(Num* n);
+double num_to_double(Num n);
+int num_is_zero(Num n);
+int num_cmp(Num x, Num y);
+int long_arith(char op, long* x, long y);
+int num_arith(char op, Num* x, Num y);
+void num_neg(Num* x);
+void num_pow(Num* x, long y);
+
 // Environment functions
+// Environments with more than this many symbols get a hash index
+#define LENV_INDEX_MIN 8
 void lenv_del(lenv*);
+unsigned lenv_hash(char* s);
+int lenv_find(lenv* e, char* s);
+void lenv_reindex(lenv* e);
 lval* lenv_get(lenv*, lval*);
+extern unsigned long lenv_version;
+extern long lenv_cache_hits;
+extern long lenv_cache_misses;
+void lenv_shadow(char* s);
+int lenv_shadowed(char* s);
+lval* lenv_get_cached(lenv* e, lval* k, lcache* c);
 void lenv_add_builtin(lenv*, char*, lbuiltin);
 void lenv_add_builtins(lenv*);
 void lenv_put(lenv*, lval*, lval*);
+void lenv_push(lenv* e, lval* k, lval* v);
 void lenv_def(lenv* e, lval* k, lval* v);
+void lenv_inherit(lenv* e, lenv* from);
 #endif
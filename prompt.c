@@ -1,5 +1,6 @@
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include "mpc.h"
 #include "types.h"
 #include "functions.h"
@@ -28,6 +29,22 @@ void add_history(char* unused) {}
 #endif
 
 int main(int argc, char** argv) {
+		// Everything the garbage collector may need to find lives below here
+		lval_gc_init(__builtin_frame_address(0));
+
+		// Options come before any files to load
+		int first = 1;
+		for (; first < argc && strncmp(argv[first], "--", 2) == 0; first++) {
+			if (strcmp(argv[first], "--no-fold") == 0) {
+				lval_fold_enabled = FALSE;
+			}
+			else if (strcmp(argv[first], "--no-jit") == 0) {
+				vm_jit_enabled = FALSE;
+			}
+			else {
+				fprintf(stderr, "Unknown option %s\n", argv[first]);
+			}
+		}
 		
     // Create parser
     Number = mpc_new("number");
@@ -63,10 +80,15 @@ int main(int argc, char** argv) {
     lenv_add_builtins(e);		
 		lval* std = lval_add(lval_sexpr(), lval_str("stdlib.lispr"));
 		builtin_load(e,std);
+#ifdef LISPR_LISP_LISTS
+		// The list builtins are left out; use their Lisp definitions instead
+		lval* lists = lval_add(lval_sexpr(), lval_str("lists.lispr"));
+		lval_del(builtin_load(e,lists));
+#endif
 		
-		if (argc >= 2) {
+		if (argc > first) {
 			// this means we have been supplied with files to load
-			for (int i = 1; i < argc; i++) {
+			for (int i = first; i < argc; i++) {
 				lval* args = lval_add(lval_sexpr(), lval_str(argv[i]));
 				lval* x = builtin_load(e, args);
 				if (x->type == LVAL_ERR) lval_println(e,x);
@@ -76,12 +98,21 @@ int main(int argc, char** argv) {
     
     while (1) {
         char* input = readline("lispr> ");
+        // End of input, as when a script is run with stdin redirected
+        if (!input) break;
         add_history(input);
         
-        // Attempt to parse input
+        // Attempt to read input, and on success evaluate it
+        lval* expr = lval_read_src(input);
         mpc_result_t r;
-        if(mpc_parse("<stdin>", input, Lispr, &r)) {
-            // On success, evaluate the input
+        if (expr) {
+            if (lval_fold_enabled) expr = lval_fold(e, expr);
+            lval* x = lval_eval(e, expr);
+            lval_println(e,x);
+            lval_del(x);
+        }
+        else if(mpc_parse("<stdin>", input, Lispr, &r)) {
+            // Should mpc accept what the reader didn't, go with mpc
 						lval* x = lval_eval(e, lval_read(r.output));
             lval_println(e,x);
             lval_del(x);
@@ -0,0 +1,39 @@
+#!/bin/bash
+# Loads a generated source file: a 2M-element list (15 MB), then
+# LOAD_BIG_MB MB (1 GB by default) of definitions cycling over a
+# thousand names, with a counter bumped every thousand lines. Checks
+# that every form ran, and prints the time and peak RSS, which streaming
+# load keeps to a small fraction of the file size. Too slow for
+# tests/run.sh; run it alone:
+#
+#   tests/load_big.sh
+#   LOAD_BIG_MB=100 LISPR=./lispr-no-mmap tests/load_big.sh
+. "$(dirname "$0")/../bench/common.sh"
+LOAD_BIG_MB=${LOAD_BIG_MB:-1024}
+
+{
+	printf "(def {big} "
+	gen_list 2000000
+	printf ")\n(def {n} 0)\n"
+	awk -v max="$((LOAD_BIG_MB * 1024 * 1024))" 'BEGIN {
+		size = 0
+		for (i = 1; size < max; i++) {
+			line = sprintf("(def {v%d} {\"name %d\" %d.25 (+ %d 1) {%d {%d %d}}})", i % 1000, i, i, i, i, i + 1, i + 2)
+			if (i % 1000 == 0) line = line "\n(def {n} (+ n 1))"
+			print line
+			size += length(line) + 1
+		}
+		printf "(print (len big))\n(print (last big))\n(print n)\n(print v%d)\n", (i - 1) % 1000
+		j = i - 1
+		printf "%d\n%d\n%d\n{\"name %d\" %d.250000 (+ %d 1) {%d {%d %d}}}\n", 2000000, 2000000, int(j / 1000), j, j, j, j, j + 1, j + 2 > "/dev/stderr"
+	}' 2> "$TMP/expected"
+} > "$TMP/big.lispr"
+
+bench "load $(( $(wc -c < "$TMP/big.lispr") / 1048576 )) MB" "$TMP/big.lispr"
+# print leaves a trailing space
+if sed 's/ $//' "$TMP/out" | diff - "$TMP/expected"; then
+	echo "PASS load_big"
+else
+	echo "FAIL load_big"
+	exit 1
+fi
@@ -0,0 +1,40 @@
+#!/bin/bash
+# Runs each tests/NAME.lispr against the interpreter named by LISPR
+# (./lispr by default) and compares what it prints with tests/NAME.out:
+#
+#   tests/run.sh                  every test
+#   tests/run.sh lists tail       just those
+#
+# tests/lists checks the list builtins against their Lisp definitions: it
+# must also pass on a build that uses those instead, such as
+#
+#   gcc -std=c99 -O2 -fcommon -DLISPR_LISP_LISTS prompt.c functions.c mpc.c \
+#       -ledit -lm -o lispr-lisp-lists
+#   LISPR=./lispr-lisp-lists tests/run.sh lists
+#
+# Tests run with a TEST_STACK_KB (default 1024) KB stack, so deep
+# recursion on the C stack fails rather than passing on a big default
+# stack. Exits non-zero if any test fails.
+cd "$(dirname "$0")/.." || exit 1
+LISPR=${LISPR:-./lispr}
+if [ ! -x "$LISPR" ]; then
+	echo "$0: no interpreter at $LISPR; build one or set LISPR" >&2
+	exit 1
+fi
+if [ $# -eq 0 ]; then
+	set -- $(cd tests && ls *.lispr | sed 's/\.lispr$//')
+fi
+failed=0
+for t in "$@"; do
+	# Drop the banner and any prompt
+	out=$( (ulimit -s "${TEST_STACK_KB:-1024}"; "$LISPR" "tests/$t.lispr" < /dev/null 2>&1) |
+		sed -e '/^Lispr Version/d' -e '/^Press ctrl+c/d' -e 's/^lispr> //' -e '/^$/d')
+	if [ "$out" = "$(cat "tests/$t.out")" ]; then
+		echo "PASS $t"
+	else
+		echo "FAIL $t"
+		diff <(echo "$out") "tests/$t.out" | head -20
+		failed=$((failed + 1))
+	fi
+done
+[ $failed -eq 0 ]
@@ -1,19 +1,32 @@
 #ifndef TYPES
 #define TYPES
+#include <stdio.h>
+#include <stdint.h>
+
 // lvals represent the result of evaluating a lisp
 // expression
 enum {LVAL_ERR, LVAL_NUM, LVAL_SYM, 
-      LVAL_FUN, LVAL_SEXPR, LVAL_QEXPR, LVAL_BOOL, LVAL_STR};
-enum {LONG, DOUBLE};
+      LVAL_FUN, LVAL_SEXPR, LVAL_QEXPR, LVAL_BOOL, LVAL_STR, LVAL_VEC};
+enum {LONG, DOUBLE, BIG};
 enum {FALSE, TRUE};
 
+// Arbitrary precision integer: a sign (1 or -1) and a magnitude in
+// base 2^32 limbs, least significant first
+typedef struct lbig {
+    int sign;
+    int count;
+    unsigned int* d;
+} lbig;
+
 // Since lvals can either hold longs or doubles, I'm creating
 // a union type, Num, to holdthe values, which should simplify
-// later code.
+// later code. Integers that don't fit in a long are held as a BIG, which
+// the Num owns; a BIG is never used for a value that fits in a long.
 typedef struct {
     union {
         long l;
         double d;
+        lbig* b;
     };
     int type;
 } Num;
@@ -23,27 +36,69 @@ struct lval;
 struct lenv;
 typedef struct lval lval;
 typedef struct lenv lenv;
+typedef struct lcode lcode;
 typedef lval*(*lbuiltin)(lenv*, lval*);
 
+// Value on vm_run's stack. Built with -DLISPR_NANBOX it is a 64-bit word
+// that holds numbers, booleans, nil and symbols directly (see
+// functions.h for the layout), and an lval* for anything else.
+#ifdef LISPR_NANBOX
+typedef uint64_t lword;
+#else
+typedef lval* lword;
+#endif
+
 struct lval {
 		int type;
 
-		// Basic
-		Num num;
-    char* err;
-    char* sym;
-		char* str;
-		int bool;
+		// Number of owners. Values are shared by reference and copied on
+		// write; see lval_ref and lval_own. Statically allocated values use
+		// LVAL_STATIC and are never freed.
+		int ref;
 
-		// Function
-    lbuiltin builtin;
-		lenv* env;
-		lval* formals;
-		lval* body;
-    
-		// Expression
-    int count;
-    struct lval** cell;
+		// Only the member matching type is valid
+		union {
+			// Basic
+			Num num;
+			char* err;
+			char* sym;
+			char* str;
+			int bool;
+
+			// Function. Lambdas are immutable: a partial application is a new
+			// function whose env binds the first 'bound' formals.
+			struct {
+				lbuiltin builtin;
+				lenv* env;
+				lval* formals;
+				lval* body;
+				lcode* code;
+				int bound;
+			};
+
+			// Expression. cell points offset slots into an array of size
+			// slots, so that popping the first cell is just an increment.
+			// A list may instead be a view of part of another list's array
+			// (see lval_slice). owner is then that list, and the view owns
+			// neither the array nor the cells in it.
+			struct {
+				int count;
+				int size;
+				int offset;
+				struct lval** cell;
+				struct lval* owner;
+			};
+
+			// Vector of len unboxed numbers, all LONG or all DOUBLE (vtype)
+			struct {
+				int len;
+				int vtype;
+				union {
+					long* vl;
+					double* vd;
+				};
+			};
+		};
 };
 
 struct lenv {
@@ -51,5 +106,78 @@ struct lenv {
     int count;
     lval** vals;
     char** syms;
+
+		// Hash index over syms. Each slot holds a position in syms/vals plus
+		// one, so 0 marks an empty slot. Small environments (such as function
+		// frames) skip the index and are scanned linearly.
+		int size;
+		int* index;
+};
+// Where a global reference in compiled code was last found: slot index of
+// env. Only valid while version equals lenv_version.
+typedef struct lcache {
+		unsigned long version;
+		lenv* env;
+		int index;
+} lcache;
+
+// Compiled lambda body, shared between copies of the lambda
+struct lcode {
+		int ref;
+		int count;
+		int* ops;
+		int nconsts;
+		lval** consts;
+		int max_stack;
+		// Number of formals, or 0 if they aren't distinct and so can't be
+		// given fixed slots
+		int nparams;
+		// One cache per OP_LOOKUP
+		int ncaches;
+		lcache* caches;
+		// Times run, and the machine code jit_compile made once that reached
+		// JIT_THRESHOLD (or NULL)
+		int calls;
+		void* jit;
+		long jit_size;
+		// Builtin symbols (nfolded of them) whose calls were folded out of
+		// the body this was compiled from. Scoping is dynamic, so any of
+		// them being bound outside the global environment later makes this
+		// code stale; unfolded is then compiled from the body as written
+		// and run instead. fold_version is the lenv_version they were last
+		// found unbound at.
+		int nfolded;
+		char** folded;
+		unsigned long fold_version;
+		lcode* unfolded;
 };
+
+// A body being run by vm_run or its machine code: the environment, the
+// operand stack and, once it has finished, the result or error in x
+typedef struct lvm {
+		lenv* e;
+		lcode* code;
+		lword* stack;
+		int sp;
+		lval* x;
+		lval** tail_f;
+		lval** tail_a;
+} lvm;
+
+// File being read by load. buf holds len bytes, NUL-terminated, of which
+// the first start have been read; row and col are where start is. If the
+// file is mapped, buf is the mapping, of which the first unmapped bytes
+// have been given back.
+typedef struct lreader {
+		FILE* file;
+		char* buf;
+		long size;
+		long start;
+		long len;
+		int eof;
+		long row;
+		long col;
+		int mapped;
+		long unmapped;
+} lreader;
 #endif